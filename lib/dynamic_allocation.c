@@ -1,224 +1,1821 @@
+#define _GNU_SOURCE
+
 #include "dynamic_allocation.h"
 
-#include <tpl.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <unistd.h>
+
+#include <assert.h>
+
+#include <stdio.h>
+
+// Allocations are sharded by the tid of the thread that made them. A shard is a slot table made of fixed size chunks:
+// the key of an allocation is its slot index in the low half and the generation of the slot in the high half.
+// The chunks never move once published, so a lookup is a bounds-checked index and needs no lock on any thread,
+// and a handle to a released slot is detected by its generation even after the slot is reused.
+// Cross-thread protocol: any thread may look an allocation up, the copies from and to its data and its release
+// are serialised by the spinlock of the slot. Only the owner hands out slots: the slots released by the owner go
+// to its local free list, the ones released by other threads to a lock-free stack the owner takes over as a whole.
+#define SHARD_SEGMENT_SIZE 1024 // Shards of the first segment of the table, must be a power of two
+#define SHARD_PROBES 32         // Entries of a segment probed for a tid before going to the next segment
+#define CHUNK_BITS 10
+#define CHUNK_SIZE (1 << CHUNK_BITS) // Slots per chunk
+#define MAX_CHUNKS 4096              // Live allocations per thread: MAX_CHUNKS * CHUNK_SIZE
+#define MAX_SLOTS ((uint32_t)MAX_CHUNKS * CHUNK_SIZE)
+
+#define KEY_SLOT(key) ((uint32_t)((key) & 0xFFFFFFFFULL))
+#define KEY_GENERATION(key) ((uint32_t)((key) >> 32))
+#define MAKE_KEY(slot, generation) (((unsigned long long)(generation) << 32) | (slot))
+
+// An allocation region has a shard of its own, found by an id that is never a tid: the high bit, the pid of the
+// process that made the region and a counter. Any thread may allocate in a region, under the lock of its shard,
+// and _reset_region releases all its allocations at once, the small ones with the slabs of the region.
+#define REGION_BIT (1ULL << 63)
+#define IS_REGION(tid) (((tid) & REGION_BIT) != 0)
+
+// A snapshot mapped by import_dynamic_data. The allocations read from it use its pages in place, copy-on-write,
+// until they are released or grown, and the last of them unmaps it.
+// A buffer adopted by _adopt_array_in is owned the same way, by a single allocation, and given back with release.
+typedef struct snapshot_mapping {
+    void *address;
+    size_t length;
+    atomic_size_t references;
+    void *context;
+    void (*release)(void *address, void *context); // NULL for a snapshot
+} snapshot_mapping;
+
+// Small allocations are packed in slabs of their size class, owned by the shard of the thread that made them.
+// Only the owner takes objects from its slabs, any thread gives them back under the spinlock of the slab.
+// A slab is aligned on its size, so the slab of an object is found from its address.
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_HEADER 64       // Objects start after the header, 16 bytes aligned
+#define SLAB_MIN_OBJECT 16
+#define SLAB_MAX_OBJECT 256
+#define SLAB_CLASSES 5       // 16, 32, 64, 128 and 256 bytes
+
+typedef struct slab {
+    struct slab *next;        // Next slab of the same class of the shard, used by the owner only
+    uint32_t object_size;
+    uint32_t free_head;       // Offset of the first released object, 0 if none
+    uint32_t bump;            // Offset of the first object never handed out
+    bool pinned;              // Holds an object pinned during _reset_region, the slab outlives the reset
+    atomic_flag lock;
+} slab;
+
+typedef struct base_data_allocation_struct {
+    void *data;                  // NULL while the slot is free
+    snapshot_mapping *mapping;   // Owner of the data if it is used in place from a snapshot, NULL if it was malloc'd
+    bool pooled;                 // The data is an object of a slab
+    unsigned long long size;     // Size of an element
+    unsigned long long capacity; // Number of elements
+    unsigned long long reserved; // Number of elements the data can hold, grown geometrically
+    uint32_t generation;         // Incremented each time the slot is released
+    unsigned int pins;           // Number of vic_pin not unpinned yet, the data is freed by the last unpin
+    bool dirty;                  // Changed since clear_dynamic_data_changes, a pin counts as a change
+    uint32_t next_free;          // Next free slot + 1 while the slot is in a free list, 0 ends the list
+    atomic_flag lock;            // Serialises the copies from and to the data of the allocation
+} base_data_allocation_struct;
+
+typedef struct allocation_shard {
+    unsigned long long tid;
+    atomic_uint next_slot;                                     // First slot never handed out
+    uint32_t local_free;                                       // Free list of the owner, slot + 1, 0 if empty
+    atomic_uint remote_free;                                   // Slots released by other threads, slot + 1, 0 if empty
+    atomic_bool imported;                                      // The free lists have to be rebuilt after an import
+    atomic_flag lock;                                          // Serialises the allocations of a region, unused otherwise
+    atomic_bool retired;                                       // Region destroyed, the next _create_region takes it over
+    slab *slabs[SLAB_CLASSES];                                 // Slabs of the owner by size class, the ones with room first
+    _Atomic(base_data_allocation_struct *) chunks[MAX_CHUNKS]; // Published with CAS, an import may race with the owner
+} allocation_shard;
+
+// The table from tid to shard is a chain of open addressing segments, each twice the size of the previous one.
+// A tid goes to the first segment with a free entry among the SHARD_PROBES from its hash, so a lookup stops at the
+// first free entry it probes. Segments and entries are published with CAS and only removed by _destroy_dynamic_memory.
+typedef struct shard_segment {
+    _Atomic(struct shard_segment *) next;
+    size_t size;
+    _Atomic(allocation_shard *) entries[];
+} shard_segment;
+
+_Atomic(shard_segment *) private_shard_table = NULL;
+
+// Visits every shard of the table, break leaves the inner loop only
+#define FOR_EACH_SHARD(shard) \
+    for (shard_segment *_segment = atomic_load(shard_table); _segment != NULL; _segment = atomic_load(&_segment->next)) \
+        for (size_t _entry = 0; _entry < _segment->size; _entry++) \
+            for (allocation_shard *shard = atomic_load(&_segment->entries[_entry]); shard != NULL; shard = NULL)
+
+// Shared heap mode: the registry and the data are carved from one MAP_SHARED file mapped before any fork, so every
+// process made afterwards sees them at the same address, and CRIU maps the file again at the same address when it
+// splits the threads into processes. The slot spinlocks are atomics in the file, so they work across processes.
+// Blocks are power of two classes with their class in a header, kept in free lists under a spinlock.
+#define SHARED_HEAP_CLASSES 48
+#define SHARED_HEAP_MIN_CLASS 5 // 32 bytes: the header and 16 bytes of payload
+
+typedef struct shared_block {
+    uint64_t size_class;
+    uint64_t next; // Offset of the next free block of the class while the block is free
+} shared_block;
+
+typedef struct shared_heap {
+    pid_t creator;                                             // The process that unmaps and removes the file
+    size_t length;
+    char path[64];
+    atomic_size_t top;                                         // Offset of the first byte never handed out
+    atomic_flag lock;                                          // Serialises the free lists between all the processes
+    uint64_t free_lists[SHARED_HEAP_CLASSES];                  // Offset of the first free block of each class, 0 if empty
+    _Atomic(shard_segment *) shard_table;                      // Replaces private_shard_table
+} shared_heap;
+
+static shared_heap *heap = NULL;
+
+_Atomic(shard_segment *) *shard_table = &private_shard_table;
+
+// Incremented by _destroy_dynamic_memory, so the threads drop their cached shard
+atomic_uint registry_epoch = 0;
+
+static _Thread_local allocation_shard *local_shard = NULL;
+static _Thread_local unsigned int local_epoch = 0;
+
+bool initialized = false;
+
+static void _heap_lock(shared_heap *from)
+{
+    while (atomic_flag_test_and_set_explicit(&from->lock, memory_order_acquire))
+    {
+        sched_yield();
+    }
+}
+
+static void _heap_unlock(shared_heap *from)
+{
+    atomic_flag_clear_explicit(&from->lock, memory_order_release);
+}
+
+static void *_shared_malloc(shared_heap *from, size_t size)
+{
+    unsigned int size_class = SHARED_HEAP_MIN_CLASS;
+    while (((size_t)1 << size_class) - sizeof(shared_block) < size) {
+        size_class++;
+    }
+    if (size_class >= SHARED_HEAP_CLASSES) {
+        return NULL;
+    }
+
+    shared_block *block = NULL;
+
+    _heap_lock(from);
+    if (from->free_lists[size_class] != 0) {
+        block = (shared_block*)((char*)from + from->free_lists[size_class]);
+        from->free_lists[size_class] = block->next;
+    }
+    else {
+        size_t offset = atomic_load(&from->top);
+        if (offset + ((size_t)1 << size_class) <= from->length) {
+            block = (shared_block*)((char*)from + offset);
+            atomic_store(&from->top, offset + ((size_t)1 << size_class));
+        }
+    }
+    _heap_unlock(from);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->size_class = size_class;
+    return block + 1;
+}
+
+static void _shared_free(shared_heap *from, void *data)
+{
+    if (data == NULL) {
+        return;
+    }
+
+    shared_block *block = (shared_block*)data - 1;
+
+    _heap_lock(from);
+    block->next = from->free_lists[block->size_class];
+    from->free_lists[block->size_class] = (uint64_t)((char*)block - (char*)from);
+    _heap_unlock(from);
+}
+
+static void *_shared_realloc(shared_heap *from, void *data, size_t size)
+{
+    if (data == NULL) {
+        return _shared_malloc(from, size);
+    }
+
+    size_t available = ((size_t)1 << ((shared_block*)data - 1)->size_class) - sizeof(shared_block);
+    if (size <= available) {
+        return data;
+    }
+
+    void *new_data = _shared_malloc(from, size);
+    if (new_data != NULL) {
+        memcpy(new_data, data, available);
+        _shared_free(from, data);
+    }
+    return new_data;
+}
+
+static void *_heap_malloc(size_t size)
+{
+    return heap != NULL ? _shared_malloc(heap, size) : malloc(size);
+}
+
+static void *_heap_calloc(size_t count, size_t size)
+{
+    if (heap == NULL) {
+        return calloc(count, size);
+    }
+
+    void *data = _shared_malloc(heap, count * size);
+    if (data != NULL) {
+        // A reused block is dirty, the file pages are zero the first time
+        memset(data, 0, count * size);
+    }
+    return data;
+}
+
+static void _heap_free(void *data)
+{
+    if (heap == NULL) {
+        free(data);
+        return;
+    }
+
+    _shared_free(heap, data);
+}
+
+static void *_heap_realloc(void *data, size_t size)
+{
+    return heap != NULL ? _shared_realloc(heap, data, size) : realloc(data, size);
+}
+
+// Without the shared heap, the data of the atomic types is kept in a heap of its own mapped MAP_SHARED on the first
+// atomic allocation, so the processes forked afterwards update the same values instead of copies of them.
+// The snapshots only carry the offset of such data and the import leaves it in place.
+#define ATOMIC_HEAP_SIZE ((size_t)1 << 30)
+
+static shared_heap *atomic_heap = NULL;
+static atomic_flag atomic_heap_lock = ATOMIC_FLAG_INIT;
+static bool forked_without_atomic_heap = false; // A process forked before the atomic heap would not share it
+
+static bool _in_atomic_heap(const void *data)
+{
+    return atomic_heap != NULL && (const char*)data >= (const char*)atomic_heap
+        && (const char*)data < (const char*)atomic_heap + atomic_heap->length;
+}
+
+// The child of a fork has the thread of its parent with another tid, the shard of the parent is not its own
+static void _forget_local_shard()
+{
+    local_shard = NULL;
+}
+
+static void _note_fork()
+{
+    if (atomic_heap == NULL) {
+        forked_without_atomic_heap = true;
+    }
+}
+
+static void _allocation_lock(base_data_allocation_struct *base_data)
+{
+    while (atomic_flag_test_and_set_explicit(&base_data->lock, memory_order_acquire))
+    {
+        sched_yield();
+    }
+}
+
+static void _allocation_unlock(base_data_allocation_struct *base_data)
+{
+    atomic_flag_clear_explicit(&base_data->lock, memory_order_release);
+}
+
+static void _region_lock(allocation_shard *shard)
+{
+    while (atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire))
+    {
+        sched_yield();
+    }
+}
+
+static void _region_unlock(allocation_shard *shard)
+{
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+
+// Returns NULL if there is no such shard, or if it cannot be made because the memory is exhausted
+static allocation_shard *_find_shard(unsigned long long tid, bool create)
+{
+    size_t hash = (size_t)(tid * 0x9E3779B97F4A7C15ULL);
+
+    _Atomic(shard_segment *) *segment_slot = shard_table;
+    size_t size = SHARD_SEGMENT_SIZE;
+    for (;;)
+    {
+        shard_segment *segment = atomic_load_explicit(segment_slot, memory_order_acquire);
+
+        if (segment == NULL && create) {
+            shard_segment *new_segment = _heap_calloc(1, sizeof(shard_segment) + size * sizeof(_Atomic(allocation_shard *)));
+            if (new_segment == NULL) {
+                return NULL;
+            }
+            new_segment->size = size;
+
+            if (atomic_compare_exchange_strong(segment_slot, &segment, new_segment)) {
+                segment = new_segment;
+            }
+            else {
+                // Another thread published the segment first
+                _heap_free(new_segment);
+            }
+        }
+
+        if (segment == NULL) {
+            return NULL;
+        }
+
+        for (size_t probe = 0; probe < SHARD_PROBES; probe++)
+        {
+            _Atomic(allocation_shard *) *slot = &segment->entries[(hash + probe) & (segment->size - 1)];
+            allocation_shard *shard = atomic_load_explicit(slot, memory_order_acquire);
+
+            if (shard == NULL && create) {
+                allocation_shard *new_shard = _heap_calloc(1, sizeof(allocation_shard));
+                if (new_shard == NULL) {
+                    return NULL;
+                }
+                new_shard->tid = tid;
+
+                if (atomic_compare_exchange_strong(slot, &shard, new_shard)) {
+                    return new_shard;
+                }
+
+                // Another thread published a shard in the slot first
+                _heap_free(new_shard);
+            }
+
+            if (shard == NULL) {
+                return NULL;
+            }
+
+            if (shard->tid == tid) {
+                return shard;
+            }
+        }
+
+        segment_slot = &segment->next;
+        size = segment->size * 2;
+    }
+}
+
+// NULL if the shard of the thread cannot be made
+static allocation_shard *_own_shard()
+{
+    unsigned int epoch = atomic_load_explicit(&registry_epoch, memory_order_acquire);
+    if (local_shard == NULL || local_epoch != epoch) {
+        local_shard = _find_shard(syscall(__NR_gettid), true);
+        local_epoch = epoch;
+    }
+
+    return local_shard;
+}
+
+static base_data_allocation_struct *_shard_entry(allocation_shard *shard, uint32_t slot, bool create)
+{
+    if (slot >= MAX_SLOTS) {
+        return NULL;
+    }
+
+    _Atomic(base_data_allocation_struct *) *chunk_slot = &shard->chunks[slot >> CHUNK_BITS];
+    base_data_allocation_struct *chunk = atomic_load_explicit(chunk_slot, memory_order_acquire);
+
+    if (chunk == NULL && create) {
+        // calloc leaves every slot free with its lock clear
+        base_data_allocation_struct *new_chunk = _heap_calloc(CHUNK_SIZE, sizeof(base_data_allocation_struct));
+        if (new_chunk == NULL) {
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(chunk_slot, &chunk, new_chunk)) {
+            chunk = new_chunk;
+        }
+        else {
+            _heap_free(new_chunk);
+        }
+    }
+
+    return chunk != NULL ? &chunk[slot & (CHUNK_SIZE - 1)] : NULL;
+}
+
+static void *_slab_take(slab *pool)
+{
+    void *object = NULL;
+
+    while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {
+        sched_yield();
+    }
+
+    if (pool->free_head != 0) {
+        object = (char*)pool + pool->free_head;
+        pool->free_head = *(uint32_t*)object;
+    }
+    else if (pool->bump + pool->object_size <= SLAB_SIZE) {
+        object = (char*)pool + pool->bump;
+        pool->bump += pool->object_size;
+    }
+
+    atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+
+    return object;
+}
+
+static slab *_slab_of(void *object)
+{
+    return (slab*)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void _slab_give(void *object)
+{
+    slab *pool = _slab_of(object);
+
+    while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {
+        sched_yield();
+    }
+
+    *(uint32_t*)object = pool->free_head;
+    pool->free_head = (uint32_t)((char*)object - (char*)pool);
+
+    atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+}
+
+// Only called by the owner of the shard, or with the lock of a region shard
+static void *_slab_malloc(allocation_shard *shard, size_t size)
+{
+    unsigned int size_class = 0;
+    while ((size_t)(SLAB_MIN_OBJECT << size_class) < size) {
+        size_class++;
+    }
+
+    slab *previous = NULL;
+    for (slab *pool = shard->slabs[size_class]; pool != NULL; previous = pool, pool = pool->next) {
+        void *object = _slab_take(pool);
+        if (object != NULL) {
+            // The slab with room moves to the front, the next allocations find it first
+            if (previous != NULL) {
+                previous->next = pool->next;
+                pool->next = shard->slabs[size_class];
+                shard->slabs[size_class] = pool;
+            }
+            return object;
+        }
+    }
+
+    slab *pool = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->object_size = SLAB_MIN_OBJECT << size_class;
+    pool->free_head = 0;
+    pool->bump = SLAB_HEADER;
+    pool->pinned = false;
+    atomic_flag_clear(&pool->lock);
+    pool->next = shard->slabs[size_class];
+    shard->slabs[size_class] = pool;
+
+    return _slab_take(pool);
+}
+
+static void _slab_free_all(allocation_shard *shard)
+{
+    for (size_t size_class = 0; size_class < SLAB_CLASSES; size_class++) {
+        slab *pool = shard->slabs[size_class];
+        while (pool != NULL) {
+            slab *next = pool->next;
+            free(pool);
+            pool = next;
+        }
+        shard->slabs[size_class] = NULL;
+    }
+}
+
+// Frees the slabs of a region that hold no pinned object, the others stay in their lists for the next allocations
+static void _slab_free_unpinned(allocation_shard *shard)
+{
+    for (size_t size_class = 0; size_class < SLAB_CLASSES; size_class++) {
+        slab **link = &shard->slabs[size_class];
+        while (*link != NULL) {
+            slab *pool = *link;
+            if (pool->pinned) {
+                pool->pinned = false;
+                link = &pool->next;
+            }
+            else {
+                *link = pool->next;
+                free(pool);
+            }
+        }
+    }
+}
+
+// The shared heap already has size classes, the slabs are only used by the private heap.
+// Only called by the owner of the shard, or with the lock of a region shard. Without a shard the data is not pooled.
+static void *_data_malloc(allocation_shard *shard, size_t size, bool *pooled)
+{
+    *pooled = shard != NULL && heap == NULL && size <= SLAB_MAX_OBJECT;
+    return *pooled ? _slab_malloc(shard, size) : _heap_malloc(size);
+}
+
+// New data for an allocation of the shard with the given tid: the objects of a region come from the slabs
+// of the region, so they are released with it, the others from the slabs of the calling thread
+static void *_data_malloc_for(unsigned long long tid, size_t size, bool *pooled)
+{
+    allocation_shard *shard = IS_REGION(tid) ? _find_shard(tid, false) : NULL;
+    if (shard == NULL) {
+        return _data_malloc(_own_shard(), size, pooled);
+    }
+
+    _region_lock(shard);
+    void *data = _data_malloc(shard, size, pooled);
+    _region_unlock(shard);
+
+    return data;
+}
+
+static void _free_data(void *data, snapshot_mapping *mapping, bool pooled)
+{
+    if (pooled) {
+        _slab_give(data);
+    }
+    else if (mapping == NULL && _in_atomic_heap(data)) {
+        _shared_free(atomic_heap, data);
+    }
+    else if (mapping == NULL) {
+        _heap_free(data);
+    }
+    else if (atomic_fetch_sub(&mapping->references, 1) == 1) {
+        if (mapping->release != NULL) {
+            mapping->release(mapping->address, mapping->context);
+        }
+        else {
+            munmap(mapping->address, mapping->length);
+        }
+        free(mapping);
+    }
+}
+
+// Must be called with the slot locked
+static bool _is_live(base_data_allocation_struct *base_data, data_pointer ptr)
+{
+    return base_data->data != NULL && base_data->generation == KEY_GENERATION(ptr.key);
+}
+
+// Returns the slot of the handle, which stays valid until _destroy_dynamic_memory.
+// The slot may have been released or reused since, check it with _is_live once it is locked.
+static base_data_allocation_struct *_lookup(data_pointer ptr)
+{
+    // The epoch is checked first, the cached shard is freed by _destroy_dynamic_memory
+    allocation_shard *shard = local_shard != NULL && local_epoch == atomic_load_explicit(&registry_epoch, memory_order_relaxed) && local_shard->tid == ptr.tid
+        ? local_shard
+        : _find_shard(ptr.tid, false);
+
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    return _shard_entry(shard, KEY_SLOT(ptr.key), false);
+}
+
+// Only called by the owner of the shard, or with the lock of a region shard. Returns MAX_SLOTS if the shard is full.
+static uint32_t _take_free_slot(allocation_shard *shard)
+{
+    if (shard->local_free == 0) {
+        shard->local_free = atomic_exchange_explicit(&shard->remote_free, 0, memory_order_acquire);
+    }
+
+    if (shard->local_free != 0) {
+        uint32_t slot = shard->local_free - 1;
+        shard->local_free = _shard_entry(shard, slot, false)->next_free;
+        return slot;
+    }
+
+    // Only the imports move next_slot otherwise, and they do not run meanwhile
+    if (atomic_load_explicit(&shard->next_slot, memory_order_relaxed) >= MAX_SLOTS) {
+        return MAX_SLOTS;
+    }
+
+    return atomic_fetch_add_explicit(&shard->next_slot, 1, memory_order_relaxed);
+}
+
+// Takes a slot for a new allocation, NULL if the shard is full or the chunk of the slot cannot be made
+static base_data_allocation_struct *_new_slot(allocation_shard *shard, uint32_t *slot)
+{
+    *slot = _take_free_slot(shard);
+    return *slot < MAX_SLOTS ? _shard_entry(shard, *slot, true) : NULL;
+}
+
+static void _give_free_slot(allocation_shard *shard, uint32_t slot, base_data_allocation_struct *base_data)
+{
+    if (shard == local_shard && local_epoch == atomic_load_explicit(&registry_epoch, memory_order_acquire)) {
+        base_data->next_free = shard->local_free;
+        shard->local_free = slot + 1;
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&shard->remote_free, memory_order_relaxed);
+    do {
+        base_data->next_free = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shard->remote_free, &head, slot + 1, memory_order_release, memory_order_relaxed));
+}
+
+// Chains the free slots of a shard again after an import changed them, while no thread allocates
+static void _rebuild_free_lists(allocation_shard *shard)
+{
+    shard->local_free = 0;
+    atomic_store(&shard->remote_free, 0);
+
+    uint32_t next_slot = atomic_load(&shard->next_slot);
+    for (uint32_t slot = next_slot; slot-- > 0;) {
+        // A slot whose chunk could not be made is left out
+        base_data_allocation_struct *base_data = _shard_entry(shard, slot, true);
+        if (base_data != NULL && base_data->data == NULL) {
+            base_data->next_free = shard->local_free;
+            shard->local_free = slot + 1;
+        }
+    }
+
+    atomic_store(&shard->imported, false);
+}
+
+// Map a new file of /dev/shm as a shared heap, only the touched pages are backed by memory
+static shared_heap *_map_shared_heap(const char *name, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/%s-%d", name, getpid());
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("open");
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        unlink(path);
+        return NULL;
+    }
+
+    shared_heap *new_heap = (shared_heap*)mapping;
+    new_heap->creator = getpid();
+    new_heap->length = size;
+    snprintf(new_heap->path, sizeof(new_heap->path), "%s", path);
+    atomic_init(&new_heap->top, (sizeof(shared_heap) + 4095) & ~(size_t)4095);
+    atomic_flag_clear(&new_heap->lock);
+    atomic_init(&new_heap->shard_table, NULL);
+
+    return new_heap;
+}
+
+static void _unmap_shared_heap(shared_heap *old_heap)
+{
+    // The other processes leave the file to the process that made it
+    if (old_heap->creator == getpid()) {
+        unlink(old_heap->path);
+    }
+    munmap(old_heap, old_heap->length);
+}
+
+void _init_dynamic_memory()
+{
+    static bool fork_handler = false;
+    if (!fork_handler) {
+        pthread_atfork(_note_fork, NULL, _forget_local_shard);
+        fork_handler = true;
+    }
+
+    initialized = true;
+}
+
+// Map the atomic heap if it is not yet. Only the forked processes use it and they inherit the mapping,
+// so the file is removed right away and is not left behind by a crash.
+static bool _map_atomic_heap()
+{
+    _init_dynamic_memory();
+
+    while (atomic_flag_test_and_set_explicit(&atomic_heap_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+
+    // The values would silently stop being shared with the processes forked before
+    if (atomic_heap == NULL && forked_without_atomic_heap) {
+        printf("The atomic types must be allocated before the processes are forked\n");
+    }
+    else if (atomic_heap == NULL) {
+        atomic_heap = _map_shared_heap("vic-atomics", ATOMIC_HEAP_SIZE);
+        if (atomic_heap != NULL) {
+            unlink(atomic_heap->path);
+        }
+    }
+
+    bool mapped = atomic_heap != NULL;
+    atomic_flag_clear_explicit(&atomic_heap_lock, memory_order_release);
+    return mapped;
+}
+
+int _init_shared_dynamic_memory(size_t size)
+{
+    if (heap != NULL) {
+        return 1;
+    }
+
+    // The allocations already made would not be visible to the other processes
+    if (atomic_load(&private_shard_table) != NULL) {
+        printf("The shared heap must be set up before the first allocation\n");
+        return 0;
+    }
+
+    shared_heap *new_heap = _map_shared_heap("vic-heap", size);
+    if (new_heap == NULL) {
+        return 0;
+    }
+
+    // The atomic types live in the shared heap like the rest
+    if (atomic_heap != NULL) {
+        _unmap_shared_heap(atomic_heap);
+        atomic_heap = NULL;
+    }
+
+    heap = new_heap;
+    shard_table = &heap->shard_table;
+    _init_dynamic_memory();
+
+    return 1;
+}
+
+int _dynamic_memory_is_shared()
+{
+    return heap != NULL;
+}
+
+void _destroy_dynamic_memory()
+{
+    if (!initialized) {
+        return;
+    }
+
+    if (heap != NULL) {
+        // The other processes leave the shared registry to the process that made it
+        if (heap->creator == getpid()) {
+            _unmap_shared_heap(heap);
+        }
+
+        heap = NULL;
+        shard_table = &private_shard_table;
+        atomic_fetch_add(&registry_epoch, 1);
+        initialized = false;
+        return;
+    }
+
+    shard_segment *segment = atomic_exchange(shard_table, NULL);
+    while (segment != NULL) {
+        for (size_t i = 0; i < segment->size; i++) {
+            allocation_shard *shard = atomic_load(&segment->entries[i]);
+            if (shard == NULL) {
+                continue;
+            }
+
+            for (size_t chunk_index = 0; chunk_index < MAX_CHUNKS; chunk_index++) {
+                base_data_allocation_struct *chunk = atomic_load(&shard->chunks[chunk_index]);
+                if (chunk == NULL) {
+                    continue;
+                }
+
+                // The slabs are freed as a whole below, the atomic heap as well
+                for (size_t j = 0; j < CHUNK_SIZE; j++) {
+                    if (!chunk[j].pooled && !_in_atomic_heap(chunk[j].data)) {
+                        _free_data(chunk[j].data, chunk[j].mapping, false);
+                    }
+                }
+                _heap_free(chunk);
+            }
+
+            _slab_free_all(shard);
+            _heap_free(shard);
+        }
+
+        shard_segment *next = atomic_load(&segment->next);
+        _heap_free(segment);
+        segment = next;
+    }
+
+    if (atomic_heap != NULL) {
+        _unmap_shared_heap(atomic_heap);
+        atomic_heap = NULL;
+    }
+
+    atomic_fetch_add(&registry_epoch, 1);
+    initialized = false;
+}
+
+static atomic_uint region_counter = 0;
+
+unsigned long long _create_region()
+{
+    initialized = true;
+
+    // The shard of a destroyed region is taken over, its slots keep their generations so the old handles stay stale
+    FOR_EACH_SHARD(shard) {
+        bool retired = true;
+        if (IS_REGION(shard->tid) && atomic_compare_exchange_strong(&shard->retired, &retired, false)) {
+            return shard->tid;
+        }
+    }
+
+    // The shard itself is made by the first allocation
+    return REGION_BIT | ((unsigned long long)getpid() << 32) | atomic_fetch_add(&region_counter, 1);
+}
+
+void _reset_region(unsigned long long region)
+{
+    allocation_shard *shard = IS_REGION(region) ? _find_shard(region, false) : NULL;
+    if (shard == NULL) {
+        return;
+    }
+
+    // A pinned allocation is only marked as released, as _deallocate does, and _unpin frees it. Its slab is kept,
+    // so the other objects of that slab are given back one by one instead of going with the slab.
+    uint32_t next_slot = atomic_load(&shard->next_slot);
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t chunk_index = 0; chunk_index < MAX_CHUNKS && ((unsigned long long)chunk_index << CHUNK_BITS) < next_slot; chunk_index++) {
+            base_data_allocation_struct *chunk = atomic_load(&shard->chunks[chunk_index]);
+            if (chunk == NULL) {
+                continue;
+            }
+
+            for (size_t j = 0; j < CHUNK_SIZE; j++) {
+                base_data_allocation_struct *base_data = &chunk[j];
+
+                _allocation_lock(base_data);
+                if (base_data->data == NULL) {
+                    // Free slot
+                }
+                else if (base_data->pins > 0) {
+                    if (pass == 0) {
+                        if (base_data->pooled) {
+                            _slab_of(base_data->data)->pinned = true;
+                        }
+                        base_data->generation++;
+                        base_data->dirty = true;
+                    }
+                }
+                else if (pass == 1) {
+                    if (!base_data->pooled) {
+                        _free_data(base_data->data, base_data->mapping, false);
+                    }
+                    else if (_slab_of(base_data->data)->pinned) {
+                        _slab_give(base_data->data);
+                    }
+                    base_data->data = NULL;
+                    base_data->mapping = NULL;
+                    base_data->pooled = false;
+                    base_data->generation++;
+                    base_data->dirty = true;
+                }
+                _allocation_unlock(base_data);
+            }
+        }
+    }
+
+    _region_lock(shard);
+    _slab_free_unpinned(shard);
+    _rebuild_free_lists(shard);
+    _region_unlock(shard);
+}
+
+void _destroy_region(unsigned long long region)
+{
+    _reset_region(region);
+
+    allocation_shard *shard = IS_REGION(region) ? _find_shard(region, false) : NULL;
+    if (shard != NULL) {
+        atomic_store(&shard->retired, true);
+    }
+}
 
-#include <threads.h>
-#include <stdatomic.h>
-#include <signal.h>
-#include <sys/syscall.h>
+data_pointer _allocate(unsigned int type_size)
+{
+    return _allocate_array_in(0, 1, type_size);
+}
 
-#define _GNU_SOURCE
-#include <unistd.h>
+data_pointer _allocate_array(unsigned int size, unsigned int type_size)
+{
+    return _allocate_array_in(0, size, type_size);
+}
 
-#include <assert.h>
+data_pointer _allocate_in(unsigned long long region, unsigned int type_size)
+{
+    return _allocate_array_in(region, 1, type_size);
+}
 
-#include <stdio.h>
+static data_pointer _allocate_array_with(unsigned long long region, unsigned int size, unsigned int type_size, bool atomic)
+{
+    data_pointer ptr = {0, 0};
+
+    initialized = true;
 
-int _compare(data_pointer val_1, data_pointer val_2) {
-    if (val_1.tid < val_2.tid) {
-        return -1;
+    allocation_shard *shard = IS_REGION(region) ? _find_shard(region, true) : _own_shard();
+    if (shard == NULL) {
+        return ptr;
     }
-    else if (val_1.tid > val_2.tid) {
-        return 1;
+
+    bool locked = IS_REGION(region);
+    if (locked) {
+        _region_lock(shard);
     }
 
-    if (val_1.key < val_2.key) {
-        return -1;
+    uint32_t slot;
+    base_data_allocation_struct *base_data = _new_slot(shard, &slot);
+
+    // malloc(0) may return NULL, which would mark the slot as free
+    size_t bytes = (size_t)type_size * size > 0 ? (size_t)type_size * size : 1;
+    bool pooled = false;
+    void *data = NULL;
+    if (base_data != NULL && atomic) {
+        data = atomic_heap != NULL ? _shared_malloc(atomic_heap, bytes) : NULL;
     }
-    else if (val_1.key > val_2.key) {
-        return 1;
+    else if (base_data != NULL) {
+        data = _data_malloc(shard, bytes, &pooled);
     }
 
-    return 0;
-}
+    if (locked) {
+        _region_unlock(shard);
+    }
 
-#define CC_NO_SHORT_NAMES
-#include "third_party/cc/cc.h"
-#define CC_CMPR data_pointer, { return _compare(val_1, val_2); }
-#define CC_HASH data_pointer, { return (val.tid + val.key) * (val.tid + val.key + 1) / 2 + val.tid; }
-#include "third_party/cc/cc.h"
+    if (data == NULL) {
+        if (base_data != NULL) {
+            _give_free_slot(shard, slot, base_data);
+        }
+        return ptr;
+    }
 
-typedef struct base_data_allocation_struct {
-    void *data;
-    unsigned long long size;
-    unsigned long long capacity;
-} base_data_allocation_struct;
+    _allocation_lock(base_data);
+    base_data->size = type_size;
+    base_data->capacity = size;
+    base_data->reserved = size;
+    base_data->data = data;
+    base_data->pooled = pooled;
+    base_data->dirty = true;
+    uint32_t generation = base_data->generation;
+    _allocation_unlock(base_data);
 
-cc_map(data_pointer, base_data_allocation_struct) dynamic_memory_storage;
-atomic_int key_counter = 0;
+    ptr.tid = shard->tid;
+    ptr.key = MAKE_KEY(slot, generation);
 
-bool initialized = false;
+    return ptr;
+}
 
-void _init_dynamic_memory()
+data_pointer _allocate_array_in(unsigned long long region, unsigned int size, unsigned int type_size)
 {
-    if (!initialized) {
-        initialized = true;
-        cc_init(&dynamic_memory_storage);
+    return _allocate_array_with(region, size, type_size, false);
+}
+
+data_pointer _allocate_atomic_array_in(unsigned long long region, unsigned int size, unsigned int type_size)
+{
+    if (heap == NULL && atomic_heap == NULL && !_map_atomic_heap()) {
+        data_pointer ptr = {0, 0};
+        return ptr;
     }
+
+    return _allocate_array_with(region, size, type_size, heap == NULL);
 }
 
-void _destroy_dynamic_memory()
+// The data is used in place like the pages of a snapshot: it cannot grow, so a resize moves it, and the owner is
+// released with the allocation. Every process has to see the data of the shared heap, so it is copied there.
+data_pointer _adopt_array_in(unsigned long long region, void* data, unsigned int size, unsigned int type_size,
+                             void* owner, void* context, void (*release)(void*, void*))
 {
-    if (!initialized) {
+    data_pointer ptr = {0, 0};
+
+    // The elements are aligned on the largest power of two dividing their size, as malloc would align them
+    size_t alignment = type_size & -type_size;
+    if (alignment > _Alignof(max_align_t)) {
+        alignment = _Alignof(max_align_t);
+    }
+
+    // An empty array would leave the slot free
+    if (heap != NULL || size == 0 || type_size == 0 || (uintptr_t)data % alignment != 0) {
+        ptr = _allocate_array_in(region, size, type_size);
+        _write_values_to_array(ptr, data, size, 0, size);
+        release(owner, context);
+        return ptr;
+    }
+
+    initialized = true;
+
+    allocation_shard *shard = IS_REGION(region) ? _find_shard(region, true) : _own_shard();
+    snapshot_mapping *mapping = shard != NULL ? malloc(sizeof(snapshot_mapping)) : NULL;
+    if (mapping == NULL) {
+        release(owner, context);
+        return ptr;
+    }
+
+    bool locked = IS_REGION(region);
+    if (locked) {
+        _region_lock(shard);
+    }
+    uint32_t slot;
+    base_data_allocation_struct *base_data = _new_slot(shard, &slot);
+    if (locked) {
+        _region_unlock(shard);
+    }
+
+    if (base_data == NULL) {
+        free(mapping);
+        release(owner, context);
+        return ptr;
+    }
+
+    mapping->address = owner;
+    mapping->length = 0;
+    atomic_init(&mapping->references, 1);
+    mapping->context = context;
+    mapping->release = release;
+
+    _allocation_lock(base_data);
+    base_data->size = type_size;
+    base_data->capacity = size;
+    base_data->reserved = size;
+    base_data->data = data;
+    base_data->mapping = mapping;
+    base_data->pooled = false;
+    base_data->dirty = true;
+    uint32_t generation = base_data->generation;
+    _allocation_unlock(base_data);
+
+    ptr.tid = shard->tid;
+    ptr.key = MAKE_KEY(slot, generation);
+
+    return ptr;
+}
+
+void _deallocate(data_pointer ptr)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
         return;
     }
 
-    if (cc_size(&dynamic_memory_storage) > 0) {
-        cc_for_each(&dynamic_memory_storage, key_ptr, value_ptr) {
-            free(value_ptr->data);
+    _allocation_lock(base_data);
+    void *data = NULL;
+    snapshot_mapping *mapping = NULL;
+    bool pooled = false;
+    if (_is_live(base_data, ptr)) {
+        base_data->generation++;
+        base_data->dirty = true;
+        // A pinned allocation is only marked as released, _unpin frees it
+        if (base_data->pins == 0) {
+            data = base_data->data;
+            mapping = base_data->mapping;
+            pooled = base_data->pooled;
+            base_data->data = NULL;
+            base_data->mapping = NULL;
+            base_data->pooled = false;
         }
     }
+    _allocation_unlock(base_data);
 
-    cc_cleanup(&dynamic_memory_storage);
-    initialized = false;
+    // A stale handle or a double release does not free the slot twice
+    if (data != NULL) {
+        _free_data(data, mapping, pooled);
+        _give_free_slot(_find_shard(ptr.tid, false), KEY_SLOT(ptr.key), base_data);
+    }
 }
 
-data_pointer _allocate(unsigned int type_size)
+data_pointer _move_allocation(data_pointer ptr, unsigned long long region)
 {
-    if (!initialized) {
-        initialized = true;
-        cc_init(&dynamic_memory_storage);
+    data_pointer result = {0, 0};
+
+    allocation_shard *shard = IS_REGION(region) ? _find_shard(region, true) : _own_shard();
+    if (shard == NULL) {
+        return result;
+    }
+    if (shard->tid == ptr.tid) {
+        return ptr;
+    }
+
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return result;
+    }
+
+    bool locked = IS_REGION(region);
+    if (locked) {
+        _region_lock(shard);
+    }
+    uint32_t slot;
+    base_data_allocation_struct *new_base_data = _new_slot(shard, &slot);
+    if (locked) {
+        _region_unlock(shard);
+    }
+
+    if (new_base_data == NULL) {
+        return result;
     }
 
-    data_pointer ptr;
-    ptr.tid = syscall(__NR_gettid);
-    ptr.key = atomic_fetch_add(&key_counter, 1);
+    _allocation_lock(base_data);
+    bool moved = _is_live(base_data, ptr) && base_data->pins == 0;
+    void *data = base_data->data;
+    snapshot_mapping *mapping = base_data->mapping;
+    bool pooled = base_data->pooled;
+    unsigned long long size = base_data->size;
+    unsigned long long capacity = base_data->capacity;
+    unsigned long long reserved = base_data->reserved;
+    if (moved && pooled) {
+        // The object would be freed with the slabs of its region, it is copied into the slabs of the destination
+        size_t bytes = reserved * size > 0 ? reserved * size : 1;
+        void *new_data = _data_malloc_for(shard->tid, bytes, &pooled);
+        moved = new_data != NULL;
+        if (moved) {
+            memcpy(new_data, data, bytes);
+            _slab_give(data);
+            data = new_data;
+        }
+    }
+    if (moved) {
+        base_data->data = NULL;
+        base_data->mapping = NULL;
+        base_data->pooled = false;
+        base_data->generation++;
+        base_data->dirty = true;
+    }
+    _allocation_unlock(base_data);
 
-    base_data_allocation_struct base_data;
-    base_data.size = type_size;
-    base_data.capacity = 1;
-    base_data.data = malloc(type_size);
+    if (!moved) {
+        _give_free_slot(shard, slot, new_base_data);
+        return result;
+    }
 
-    cc_insert(&dynamic_memory_storage, ptr, base_data);
+    _give_free_slot(_find_shard(ptr.tid, false), KEY_SLOT(ptr.key), base_data);
 
-    return ptr;
+    _allocation_lock(new_base_data);
+    new_base_data->data = data;
+    new_base_data->mapping = mapping;
+    new_base_data->pooled = pooled;
+    new_base_data->size = size;
+    new_base_data->capacity = capacity;
+    new_base_data->reserved = reserved;
+    new_base_data->dirty = true;
+    uint32_t generation = new_base_data->generation;
+    _allocation_unlock(new_base_data);
+
+    result.tid = shard->tid;
+    result.key = MAKE_KEY(slot, generation);
+
+    return result;
 }
 
-data_pointer _allocate_array(unsigned int size, unsigned int type_size)
+void* _pin(data_pointer ptr)
 {
-    if (!initialized) {
-        initialized = true;
-        cc_init(&dynamic_memory_storage);
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return NULL;
     }
 
-    data_pointer ptr;
-    ptr.tid = syscall(__NR_gettid);
-    ptr.key = atomic_fetch_add(&key_counter, 1);
+    _allocation_lock(base_data);
+    void *data = NULL;
+    if (_is_live(base_data, ptr)) {
+        base_data->pins++;
+        base_data->dirty = true;
+        data = base_data->data;
+    }
+    _allocation_unlock(base_data);
+
+    return data;
+}
 
-    base_data_allocation_struct base_data;
-    base_data.size = type_size;
-    base_data.capacity = size;
-    base_data.data = malloc(type_size * size);
+void _unpin(data_pointer ptr)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return;
+    }
 
-    cc_insert(&dynamic_memory_storage, ptr, base_data);
+    _allocation_lock(base_data);
+    void *data = NULL;
+    snapshot_mapping *mapping = NULL;
+    bool pooled = false;
+    if (base_data->pins > 0 && --base_data->pins == 0 && base_data->generation != KEY_GENERATION(ptr.key)) {
+        // Released while pinned
+        data = base_data->data;
+        mapping = base_data->mapping;
+        pooled = base_data->pooled;
+        base_data->data = NULL;
+        base_data->mapping = NULL;
+        base_data->pooled = false;
+    }
+    _allocation_unlock(base_data);
 
-    return ptr;
+    if (data != NULL) {
+        _free_data(data, mapping, pooled);
+        _give_free_slot(_find_shard(ptr.tid, false), KEY_SLOT(ptr.key), base_data);
+    }
 }
 
-void _deallocate(data_pointer ptr)
+// Must be called with the slot locked. Returns false if the data cannot move because it is pinned or realloc failed.
+static bool _reserve_locked(data_pointer ptr, base_data_allocation_struct *base_data, unsigned long long capacity)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
-    if (base_data != NULL) {
-        free(base_data->data);
-        cc_erase(&dynamic_memory_storage, ptr);
+    if (capacity <= base_data->reserved) {
+        return true;
     }
 
-    if (cc_size(&dynamic_memory_storage) == 0) {
-        initialized = false;
-        cc_cleanup(&dynamic_memory_storage);
+    if (base_data->pins > 0) {
+        return false;
     }
+
+    unsigned long long reserved = base_data->reserved > 0 ? base_data->reserved : 1;
+    while (reserved < capacity) {
+        reserved *= 2;
+    }
+
+    void *data = NULL;
+    if (base_data->mapping != NULL || base_data->pooled) {
+        // The pages of a snapshot and the objects of a slab cannot grow, the data moves
+        bool pooled = false;
+        data = _data_malloc_for(ptr.tid, reserved * base_data->size, &pooled);
+        if (data == NULL) {
+            return false;
+        }
+        memcpy(data, base_data->data, base_data->capacity * base_data->size);
+        _free_data(base_data->data, base_data->mapping, base_data->pooled);
+        base_data->mapping = NULL;
+        base_data->pooled = pooled;
+    }
+    else {
+        // glibc moves big blocks with mremap, so growing a large array does not copy it
+        data = _in_atomic_heap(base_data->data) ? _shared_realloc(atomic_heap, base_data->data, reserved * base_data->size)
+                                                : _heap_realloc(base_data->data, reserved * base_data->size);
+        if (data == NULL) {
+            return false;
+        }
+    }
+
+    base_data->data = data;
+    base_data->dirty = true;
+    base_data->reserved = reserved;
+    return true;
 }
 
-void* _read(data_pointer ptr)
+int _reserve(data_pointer ptr, unsigned long long capacity)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
-    if (base_data != NULL) {
-        return base_data->data;
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return 0;
+    }
+
+    _allocation_lock(base_data);
+    int result = _is_live(base_data, ptr) && _reserve_locked(ptr, base_data, capacity);
+    _allocation_unlock(base_data);
+
+    return result;
+}
+
+int _resize(data_pointer ptr, unsigned long long capacity)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return 0;
+    }
+
+    _allocation_lock(base_data);
+    int result = _is_live(base_data, ptr) && _reserve_locked(ptr, base_data, capacity);
+    if (result) {
+        if (capacity > base_data->capacity) {
+            memset((char*)base_data->data + base_data->capacity * base_data->size, 0, (capacity - base_data->capacity) * base_data->size);
+        }
+        base_data->capacity = capacity;
+        base_data->dirty = true;
+    }
+    _allocation_unlock(base_data);
+
+    return result;
+}
+
+int _push_back(data_pointer ptr, void* value)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return 0;
+    }
+
+    _allocation_lock(base_data);
+    int result = _is_live(base_data, ptr) && _reserve_locked(ptr, base_data, base_data->capacity + 1);
+    if (result) {
+        memcpy((char*)base_data->data + base_data->capacity * base_data->size, value, base_data->size);
+        base_data->capacity++;
+        base_data->dirty = true;
+    }
+    _allocation_unlock(base_data);
+
+    return result;
+}
+
+int _allocation_size(data_pointer ptr, unsigned long long* type_size, unsigned long long* capacity)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return 0;
+    }
+
+    _allocation_lock(base_data);
+    int found = _is_live(base_data, ptr);
+    if (found) {
+        *type_size = base_data->size;
+        *capacity = base_data->capacity;
     }
+    _allocation_unlock(base_data);
+
+    return found;
+}
 
-    return NULL;
+// The pointers returned by _read and _read_from_array are not protected against concurrent writes,
+// prefer _read_to and _read_from_array_to
+void* _read(data_pointer ptr)
+{
+    return _read_from_array(ptr, 0);
 }
 
 void* _read_from_array(data_pointer ptr, unsigned int index)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
-    if (base_data != NULL) {
-        return (void*)((char*)base_data->data + index * base_data->size);
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL) {
+        return NULL;
     }
 
-    return NULL;
+    _allocation_lock(base_data);
+    void *result = _is_live(base_data, ptr) ? (void*)((char*)base_data->data + index * base_data->size) : NULL;
+    _allocation_unlock(base_data);
+
+    return result;
 }
 
-void _read_values_from_array(data_pointer ptr, void* out_array, unsigned int size, unsigned int start_index, unsigned int end_index)
+void _read_to(data_pointer ptr, void* out_value)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
+    _read_from_array_to(ptr, 0, out_value);
+}
+
+void _read_from_array_to(data_pointer ptr, unsigned int index, void* out_value)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
     if (base_data != NULL) {
-        memcpy(out_array, (char*)base_data->data + start_index * base_data->size, (end_index - start_index) * base_data->size);
+        _allocation_lock(base_data);
+        if (_is_live(base_data, ptr)) {
+            memcpy(out_value, (char*)base_data->data + index * base_data->size, base_data->size);
+        }
+        _allocation_unlock(base_data);
     }
 }
 
-void _write(data_pointer ptr, void* value)
+void _read_values_from_array(data_pointer ptr, void* out_array, unsigned int size, unsigned int start_index, unsigned int end_index)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
+    base_data_allocation_struct *base_data = _lookup(ptr);
     if (base_data != NULL) {
-        memcpy(base_data->data, value, base_data->size);
+        _allocation_lock(base_data);
+        if (_is_live(base_data, ptr)) {
+            memcpy(out_array, (char*)base_data->data + start_index * base_data->size, (end_index - start_index) * base_data->size);
+        }
+        _allocation_unlock(base_data);
+    }
+}
+
+// The data of a live allocation only moves on a resize or a release, which the caller rules out, and on an import,
+// which the execution flow of the caller waits for. Every element of the allocation is aligned on its size.
+void* _atomic_target(data_pointer ptr, unsigned int type_size)
+{
+    base_data_allocation_struct *base_data = _lookup(ptr);
+    if (base_data == NULL || base_data->data == NULL || base_data->generation != KEY_GENERATION(ptr.key) || base_data->size != type_size) {
+        return NULL;
+    }
+
+    // The slot is only locked by the first change since clear_dynamic_data_changes
+    if (!base_data->dirty) {
+        _allocation_lock(base_data);
+        base_data->dirty = true;
+        _allocation_unlock(base_data);
     }
+
+    return base_data->data;
+}
+
+void _write(data_pointer ptr, void* value)
+{
+    _write_to_array(ptr, 0, value);
 }
 
 void _write_to_array(data_pointer ptr, unsigned int index, void* value)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
+    base_data_allocation_struct *base_data = _lookup(ptr);
     if (base_data != NULL) {
-        memcpy((char*)base_data->data + index * base_data->size, value, base_data->size);
+        _allocation_lock(base_data);
+        if (_is_live(base_data, ptr)) {
+            memcpy((char*)base_data->data + index * base_data->size, value, base_data->size);
+            base_data->dirty = true;
+        }
+        _allocation_unlock(base_data);
     }
 }
 
 void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, unsigned int start_index, unsigned int end_index)
 {
-    base_data_allocation_struct *base_data = cc_get(&dynamic_memory_storage, ptr);
+    base_data_allocation_struct *base_data = _lookup(ptr);
     if (base_data != NULL) {
-        memcpy((char*)base_data->data + start_index * base_data->size, values, (end_index - start_index) * base_data->size);
+        _allocation_lock(base_data);
+        if (_is_live(base_data, ptr)) {
+            memcpy((char*)base_data->data + start_index * base_data->size, values, (end_index - start_index) * base_data->size);
+            base_data->dirty = true;
+        }
+        _allocation_unlock(base_data);
+    }
+}
+
+// Snapshot file of export_dynamic_data: a header, the index of every slot handed out and then the data of the
+// live allocations. The data area starts on a page and the allocations of a page or more are page aligned,
+// so import_dynamic_data maps the file once and leaves the data in place.
+#define SNAPSHOT_MAGIC 0x5041454843495600ULL // "\0VICHEAP"
+#define SNAPSHOT_ALIGN 16                    // Alignment of the small allocations, enough for any scalar type
+#define SNAPSHOT_IOV_BATCH 512               // iovecs per writev, below IOV_MAX
+#define SNAPSHOT_ATOMIC_HEAP (1ULL << 63)    // Flag of an offset into the atomic heap, the data is not in the file
+
+typedef struct snapshot_header {
+    uint64_t magic;
+    uint64_t count;  // Number of records in the index
+    uint64_t length; // Size of the file
+} snapshot_header;
+
+typedef struct snapshot_record {
+    uint64_t key;      // Slot and generation, so the handles held by the program stay valid
+    uint64_t tid;
+    uint64_t size;     // 0 for a free slot
+    uint64_t capacity;
+    uint64_t offset;   // Offset of the data from the start of the file, or SNAPSHOT_ATOMIC_HEAP and its offset there
+} snapshot_record;
+
+static size_t _align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static bool _write_iov(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            perror("writev");
+            return false;
+        }
+
+        // Skip what a short write already wrote
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+// Must be called while the execution flows are quiesced, the data is written without holding the slot locks
+static void _export_dynamic_data(char* filename, bool changes_only)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    size_t count = 0;
+    size_t reserved = 1024;
+    snapshot_record *records = malloc(reserved * sizeof(snapshot_record));
+    void **datas = malloc(reserved * sizeof(void*));
+
+    // Every slot handed out is written, the free ones with a size of 0, so the importing process
+    // gets the same generations and the handles held by the program keep pointing to the same data
+    FOR_EACH_SHARD(shard) {
+
+        uint32_t next_slot = atomic_load(&shard->next_slot);
+        for (uint32_t slot = 0; slot < next_slot; slot++) {
+            base_data_allocation_struct *base_data = _shard_entry(shard, slot, false);
+            if (base_data == NULL || (changes_only && !base_data->dirty)) {
+                continue;
+            }
+
+            if (count == reserved) {
+                reserved *= 2;
+                records = realloc(records, reserved * sizeof(snapshot_record));
+                datas = realloc(datas, reserved * sizeof(void*));
+            }
+
+            _allocation_lock(base_data);
+            bool live = base_data->data != NULL;
+            records[count].key = MAKE_KEY(slot, base_data->generation);
+            records[count].tid = shard->tid;
+            records[count].size = live ? base_data->size : 0;
+            records[count].capacity = live ? base_data->capacity : 0;
+            records[count].offset = live && _in_atomic_heap(base_data->data)
+                ? SNAPSHOT_ATOMIC_HEAP | (uint64_t)((char*)base_data->data - (char*)atomic_heap) : 0;
+            datas[count] = base_data->data;
+            _allocation_unlock(base_data);
+
+            count++;
+        }
+    }
+
+    size_t length = _align_up(sizeof(snapshot_header) + count * sizeof(snapshot_record), page_size);
+    for (size_t i = 0; i < count; i++) {
+        size_t bytes = records[i].size * records[i].capacity;
+        if (records[i].offset & SNAPSHOT_ATOMIC_HEAP) {
+            continue;
+        }
+        records[i].offset = _align_up(length, bytes >= page_size ? page_size : SNAPSHOT_ALIGN);
+        length = records[i].offset + bytes;
+    }
+
+    snapshot_header header = {SNAPSHOT_MAGIC, count, length};
+
+    // A previous snapshot of the same process may still be mapped by its importer, a new inode leaves it untouched
+    unlink(filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("open");
+        free(records);
+        free(datas);
+        return;
+    }
+
+    char *zeros = calloc(1, page_size);
+
+    struct iovec iov[SNAPSHOT_IOV_BATCH];
+    int iov_count = 0;
+    iov[iov_count++] = (struct iovec){&header, sizeof(header)};
+    iov[iov_count++] = (struct iovec){records, count * sizeof(snapshot_record)};
+
+    bool ok = true;
+    size_t position = sizeof(header) + count * sizeof(snapshot_record);
+    for (size_t i = 0; i < count && ok; i++) {
+        size_t bytes = records[i].size * records[i].capacity;
+        if (bytes == 0 || (records[i].offset & SNAPSHOT_ATOMIC_HEAP)) {
+            continue;
+        }
+
+        if (iov_count + 2 > SNAPSHOT_IOV_BATCH) {
+            ok = _write_iov(fd, iov, iov_count);
+            iov_count = 0;
+        }
+
+        if (records[i].offset > position) {
+            iov[iov_count++] = (struct iovec){zeros, records[i].offset - position};
+        }
+        iov[iov_count++] = (struct iovec){datas[i], bytes};
+        position = records[i].offset + bytes;
+    }
+
+    if (ok) {
+        ok = _write_iov(fd, iov, iov_count);
     }
+    if (ok && position < length) {
+        // The index alone is padded to a page
+        ok = ftruncate(fd, length) == 0;
+    }
+    if (!ok) {
+        printf("Failed to write the dynamic data snapshot %s\n", filename);
+    }
+
+    close(fd);
+    free(zeros);
+    free(records);
+    free(datas);
 }
 
 void export_dynamic_data(char* filename)
 {
-    data_pointer key = {0, 0};
-    base_data_allocation_struct value = {NULL, 0, 0};
+    _export_dynamic_data(filename, false);
+}
+
+void export_dynamic_data_changes(char* filename)
+{
+    _export_dynamic_data(filename, true);
+}
+
+void clear_dynamic_data_changes()
+{
+    FOR_EACH_SHARD(shard) {
+
+        for (size_t chunk_index = 0; chunk_index < MAX_CHUNKS; chunk_index++) {
+            base_data_allocation_struct *chunk = atomic_load(&shard->chunks[chunk_index]);
+            if (chunk == NULL) {
+                continue;
+            }
+
+            for (size_t j = 0; j < CHUNK_SIZE; j++) {
+                chunk[j].dirty = false;
+            }
+        }
+    }
+}
+
+// Applies a snapshot to the registry without rebuilding the free lists, so many snapshots can be applied at once
+static void _import_snapshot(char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || (size_t)file_stat.st_size < sizeof(snapshot_header)) {
+        printf("Invalid dynamic data snapshot %s\n", filename);
+        close(fd);
+        return;
+    }
+
+    size_t length = (size_t)file_stat.st_size;
+    void *address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    // The mapping keeps the file alive
+    close(fd);
+    unlink(filename);
+
+    if (address == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    snapshot_header *header = (snapshot_header*)address;
+    snapshot_record *records = (snapshot_record*)(header + 1);
+    if (header->magic != SNAPSHOT_MAGIC || header->length != length
+        || header->count > (length - sizeof(snapshot_header)) / sizeof(snapshot_record)) {
+        printf("Invalid dynamic data snapshot %s\n", filename);
+        munmap(address, length);
+        return;
+    }
+
+    // The import holds a reference until every allocation took its own
+    snapshot_mapping *mapping = malloc(sizeof(snapshot_mapping));
+    mapping->address = address;
+    mapping->length = length;
+    atomic_init(&mapping->references, 1);
+    mapping->context = NULL;
+    mapping->release = NULL;
+
+    initialized = true;
+
+    for (uint64_t i = 0; i < header->count; i++) {
+        snapshot_record *record = &records[i];
+        size_t bytes = record->size * record->capacity;
 
-    tpl_bin tb;
-    tpl_node *tn = tpl_map("A(UUUUB)", &key.key, &key.tid, &value.size, &value.capacity, &tb);
+        allocation_shard *shard = _find_shard(record->tid, true);
+        uint32_t slot = KEY_SLOT(record->key);
+        base_data_allocation_struct *base_data = shard != NULL ? _shard_entry(shard, slot, true) : NULL;
+        if (base_data == NULL) {
+            printf("No room for an allocation of the dynamic data snapshot %s\n", filename);
+            continue;
+        }
+
+        void *data = NULL;
+        snapshot_mapping *data_mapping = NULL;
+        uint64_t atomic_offset = record->offset & ~SNAPSHOT_ATOMIC_HEAP;
+        if (record->offset & SNAPSHOT_ATOMIC_HEAP) {
+            // The processes forked by the importer share the atomic heap with it, the data is already there
+            if (record->size > 0 && atomic_heap != NULL && atomic_offset < atomic_heap->length) {
+                data = (char*)atomic_heap + atomic_offset;
+            }
+        }
+        else if (bytes > 0 && record->offset <= length && bytes <= length - record->offset) {
+            data = (char*)address + record->offset;
+            data_mapping = mapping;
+            atomic_fetch_add(&mapping->references, 1);
+        }
+        else if (record->size > 0) {
+            // An empty array, malloc(1) keeps the slot live. It never comes from a slab: the slabs of the
+            // importing thread would outlive the import for nothing and a region frees its own slabs as a whole
+            data = _heap_malloc(1);
+        }
 
-    cc_for_each(&dynamic_memory_storage, key_ptr, value_ptr) {
-        key.key = key_ptr->key;
-        key.tid = key_ptr->tid;
+        // The copy of the slot made before the process was split is replaced, generation included
+        _allocation_lock(base_data);
+        void *old_data = base_data->data;
+        snapshot_mapping *old_mapping = base_data->mapping;
+        bool old_pooled = base_data->pooled;
+        base_data->data = data;
+        base_data->dirty = true;
+        base_data->mapping = data_mapping;
+        base_data->pooled = false;
+        base_data->size = data != NULL ? record->size : 0;
+        base_data->capacity = data != NULL ? record->capacity : 0;
+        base_data->reserved = base_data->capacity;
+        base_data->generation = KEY_GENERATION(record->key);
+        _allocation_unlock(base_data);
 
-        tb.addr = value_ptr->data;
-        tb.sz = value_ptr->size * value_ptr->capacity;
-        value.size = value_ptr->size;
-        value.capacity = value_ptr->capacity;
+        // The data of the atomic heap is released by the process that releases the allocation
+        if (!_in_atomic_heap(old_data)) {
+            _free_data(old_data, old_mapping, old_pooled);
+        }
 
-        tpl_pack(tn, 1);
+        unsigned int next_slot = atomic_load(&shard->next_slot);
+        while (next_slot <= slot && !atomic_compare_exchange_weak(&shard->next_slot, &next_slot, slot + 1));
+        atomic_store(&shard->imported, true);
     }
 
-    tpl_dump(tn, TPL_FILE, filename);
-    tpl_free(tn);
+    _free_data(address, mapping, false);
+}
+
+static void _rebuild_imported_shards()
+{
+    FOR_EACH_SHARD(shard) {
+        if (atomic_load(&shard->imported)) {
+            _rebuild_free_lists(shard);
+        }
+    }
 }
 
 void import_dynamic_data(char* filename)
 {
-    data_pointer key = {0, 0};
-    base_data_allocation_struct value = {NULL, 0, 0};
+    _import_snapshot(filename);
+    _rebuild_imported_shards();
+}
+
+typedef struct import_job {
+    char **filenames;
+    int count;
+    atomic_int next; // Index of the next snapshot to take
+} import_job;
+
+static void *_import_worker(void *data)
+{
+    import_job *job = (import_job*)data;
+
+    for (;;) {
+        int index = atomic_fetch_add(&job->next, 1);
+        if (index >= job->count) {
+            return NULL;
+        }
+
+        _import_snapshot(job->filenames[index]);
+    }
+}
+
+void import_dynamic_data_parallel(char** filenames, int count)
+{
+    import_job job;
+    job.filenames = filenames;
+    job.count = count;
+    atomic_init(&job.next, 0);
 
-    tpl_bin tb;
-    tpl_node *tn = tpl_map("A(UUUUB)", &key.key, &key.tid, &value.size, &value.capacity, &tb);
-    tpl_load(tn, TPL_FILE, filename);
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = processors > 0 && processors < count ? (int)processors : count;
+
+    // The calling thread is one of the workers
+    pthread_t *threads = malloc(sizeof(pthread_t) * (workers > 1 ? workers - 1 : 1));
+    int started = 0;
+    while (started < workers - 1 && pthread_create(&threads[started], NULL, _import_worker, &job) == 0) {
+        started++;
+    }
 
-    while (tpl_unpack(tn, 1) > 0) {
-        value.data = tb.addr;
+    _import_worker(&job);
 
-        cc_insert(&dynamic_memory_storage, key, value);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
+    free(threads);
 
-    tpl_free(tn);
+    _rebuild_imported_shards();
 }
@@ -1,10 +1,17 @@
 #ifndef DYNAMIC_ALLOCATION_H
 #define DYNAMIC_ALLOCATION_H
 
+#include <stdatomic.h>
+#include <stddef.h>
+
 typedef struct _vic_ef_t vic_ef_t;
 
-void _ef_lock(vic_ef_t* ef);
-void _ef_unlock(vic_ef_t* ef);
+// Mark an operation of the execution flow, the transformation of the vic waits for it to finish
+void _ef_enter(vic_ef_t* ef);
+void _ef_leave(vic_ef_t* ef);
+
+// Allocation region of the data_ptr allocations made for the execution flow, 0 for none
+unsigned long long _ef_region(vic_ef_t* ef);
 
 typedef struct data_pointer {
     unsigned long long int key;
@@ -14,15 +21,69 @@ typedef struct data_pointer {
 void _init_dynamic_memory();
 void _destroy_dynamic_memory();
 
+// Switch to the shared heap mode before the first allocation: the allocations are made in a shared file of the
+// given size, visible at the same address to every process of the program, so the transformations move no data.
+// Returns 0 if the file cannot be mapped or allocations were already made.
+int _init_shared_dynamic_memory(size_t size);
+int _dynamic_memory_is_shared();
+
+// The allocations return a null handle (tid 0) if the memory is exhausted or the thread or region already holds
+// MAX_CHUNKS * CHUNK_SIZE live allocations
 data_pointer _allocate(unsigned int type_size);
 data_pointer _allocate_array(unsigned int size, unsigned int type_size);
 
+// Allocation regions: the allocations made in a region are released all at once by _reset_region, the small ones
+// by freeing the slabs of the region. A region of 0 stands for the allocations of the calling thread.
+// _reset_region must not run while other threads use the allocations of the region, a pinned one is freed by its last _unpin.
+// A destroyed region is reset and its id may be handed out again by _create_region, the old handles stay stale.
+unsigned long long _create_region();
+void _reset_region(unsigned long long region);
+void _destroy_region(unsigned long long region);
+
+data_pointer _allocate_in(unsigned long long region, unsigned int type_size);
+data_pointer _allocate_array_in(unsigned long long region, unsigned int size, unsigned int type_size);
+
+// Same for the types defined with define_atomic_data_ptr, their data is shared with the processes forked afterwards.
+// Without the shared heap the first atomic allocation must come before any fork, a null handle is returned otherwise.
+data_pointer _allocate_atomic_array_in(unsigned long long region, unsigned int size, unsigned int type_size);
+
+// Make an allocation of a region out of a buffer of the caller without copying it, release(owner, context) is called
+// once the allocation no longer uses it, or right away if the buffer is copied or no allocation is made.
+// The buffer is copied if it is not aligned for the elements or the heap is shared between processes.
+data_pointer _adopt_array_in(unsigned long long region, void* data, unsigned int size, unsigned int type_size,
+                             void* owner, void* context, void (*release)(void*, void*));
+
+// Move an allocation to a region and return its new handle, the old one becomes stale. The data stays in place
+// unless it is an object of a slab, which is copied. Returns a null handle if there is no such allocation or it is pinned.
+data_pointer _move_allocation(data_pointer ptr, unsigned long long region);
+
 void _deallocate(data_pointer ptr);
 
+// Size of the elements and number of elements of an allocation, returns 0 if there is no such allocation
+int _allocation_size(data_pointer ptr, unsigned long long* type_size, unsigned long long* capacity);
+
+// Keep the data of the allocation in place until _unpin and return it, NULL if there is no such allocation.
+// A release while pinned is deferred to the last _unpin.
+void* _pin(data_pointer ptr);
+void _unpin(data_pointer ptr);
+
+// Change the number of elements of an allocation, the data is reallocated geometrically so appends are amortized O(1).
+// The new elements of _resize are zeroed. Return 0 if there is no such allocation, if it is pinned and would have to
+// move, or if the memory is exhausted. The pointers returned by _read and _read_from_array are invalidated.
+int _reserve(data_pointer ptr, unsigned long long capacity);
+int _resize(data_pointer ptr, unsigned long long capacity);
+int _push_back(data_pointer ptr, void* value);
+
 void* _read(data_pointer ptr);
 void* _read_from_array(data_pointer ptr, unsigned int index);
+void _read_to(data_pointer ptr, void* out_value);
+void _read_from_array_to(data_pointer ptr, unsigned int index, void* out_value);
 void _read_values_from_array(data_pointer ptr, void* out_array, unsigned int size, unsigned int start_index, unsigned int end_index);
 
+// Address of the first element for the atomic operations, NULL if there is no such allocation or its elements
+// are not type_size bytes. The slot is not locked: the allocation must not be released or resized meanwhile.
+void* _atomic_target(data_pointer ptr, unsigned int type_size);
+
 void _write(data_pointer ptr, void* value);
 void _write_to_array(data_pointer ptr, unsigned int index, void* value);
 void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, unsigned int start_index, unsigned int end_index);
@@ -40,8 +101,17 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
         void (*write)(struct _ptr_##type ptr, type value); \
         void (*write_to_array)(struct _ptr_##type ptr, unsigned int index, type value); \
         void (*write_values_to_array)(struct _ptr_##type ptr, type values[], unsigned int size, unsigned int start_index, unsigned int end_index); \
+        type* (*pin)(struct _ptr_##type ptr); \
+        void (*unpin)(struct _ptr_##type ptr); \
+        int (*resize)(struct _ptr_##type ptr, unsigned int size); \
+        int (*reserve)(struct _ptr_##type ptr, unsigned int capacity); \
+        int (*push_back)(struct _ptr_##type ptr, type value); \
+        type (*fetch_add)(struct _ptr_##type ptr, type value); \
+        type (*exchange)(struct _ptr_##type ptr, type value); \
+        int (*compare_exchange)(struct _ptr_##type ptr, type* expected, type desired); \
     } _ptr_functions_##type; \
     \
+    struct _ptr_##type _from_base_##type(data_pointer base_ptr, vic_ef_t* ef); \
     struct _ptr_##type _allocate_##type(vic_ef_t* ef); \
     struct _ptr_##type _allocate_array_##type(unsigned int size, vic_ef_t* ef); \
     void _deallocate_##type(struct _ptr_##type ptr); \
@@ -51,6 +121,14 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
     void _write_##type(struct _ptr_##type ptr, type value); \
     void _write_to_array_##type(struct _ptr_##type ptr, unsigned int index, type value); \
     void _write_values_to_array_##type(struct _ptr_##type ptr, type values[], unsigned int size, unsigned int start_index, unsigned int end_index); \
+    type* _pin_##type(struct _ptr_##type ptr); \
+    void _unpin_##type(struct _ptr_##type ptr); \
+    int _resize_##type(struct _ptr_##type ptr, unsigned int size); \
+    int _reserve_##type(struct _ptr_##type ptr, unsigned int capacity); \
+    int _push_back_##type(struct _ptr_##type ptr, type value); \
+    type _fetch_add_##type(struct _ptr_##type ptr, type value); \
+    type _exchange_##type(struct _ptr_##type ptr, type value); \
+    int _compare_exchange_##type(struct _ptr_##type ptr, type* expected, type desired); \
     \
     typedef struct _ptr_##type { \
         unsigned long long int key; \
@@ -59,7 +137,8 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
         vic_ef_t* ef; \
     } _ptr_##type;
 
-#define data_ptr_implementation(type) \
+// The atomic functions are only set by data_ptr_atomic_implementation, which allocates with _allocate_atomic_array_in
+#define _data_ptr_implementation(type, allocate_array_in, fetch_add, exchange, compare_exchange) \
     _ptr_functions_##type _ptr_##type##_functions = { \
         _allocate_##type, \
         _allocate_array_##type, \
@@ -69,45 +148,51 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
         _read_values_from_array_##type, \
         _write_##type, \
         _write_to_array_##type, \
-        _write_values_to_array_##type \
+        _write_values_to_array_##type, \
+        _pin_##type, \
+        _unpin_##type, \
+        _resize_##type, \
+        _reserve_##type, \
+        _push_back_##type, \
+        fetch_add, \
+        exchange, \
+        compare_exchange \
     }; \
     \
-    _ptr_##type _allocate_##type(vic_ef_t* ef) { \
-        data_pointer base_ptr = _allocate(sizeof(type)); \
+    _ptr_##type _from_base_##type(data_pointer base_ptr, vic_ef_t* ef) { \
         _ptr_##type _ptr; \
         _ptr.key = base_ptr.key; \
         _ptr.tid = base_ptr.tid; \
-        _ptr.functions = &_ptr_##type##_functions; \
-        _ptr.ef = ef; \
+        _ptr.functions = base_ptr.tid != 0 ? &_ptr_##type##_functions : NULL; \
+        _ptr.ef = base_ptr.tid != 0 ? ef : NULL; \
         return _ptr; \
     } \
     \
+    _ptr_##type _allocate_##type(vic_ef_t* ef) { \
+        return _from_base_##type(allocate_array_in(_ef_region(ef), 1, sizeof(type)), ef); \
+    } \
+    \
     _ptr_##type _allocate_array_##type(unsigned int size, vic_ef_t* ef) { \
-        data_pointer base_ptr = _allocate_array(size, sizeof(type)); \
-        _ptr_##type _ptr; \
-        _ptr.key = base_ptr.key; \
-        _ptr.tid = base_ptr.tid; \
-        _ptr.functions = &_ptr_##type##_functions; \
-        _ptr.ef = ef; \
-        return _ptr; \
+        return _from_base_##type(allocate_array_in(_ef_region(ef), size, sizeof(type)), ef); \
     } \
     \
     void _deallocate_##type(_ptr_##type ptr) { \
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
+        _ef_enter(ptr.ef); \
         _deallocate(base_ptr); \
-        _ef_unlock(ptr.ef); \
+        _ef_leave(ptr.ef); \
     } \
     \
     type _read_##type(const _ptr_##type ptr) { \
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
-        type value = *(type*)_read(base_ptr); \
-        _ef_unlock(ptr.ef); \
+        type value; \
+        _ef_enter(ptr.ef); \
+        _read_to(base_ptr, &value); \
+        _ef_leave(ptr.ef); \
         return value; \
     } \
     \
@@ -115,9 +200,10 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
-        type value = *(type*)_read_from_array(base_ptr, index); \
-        _ef_unlock(ptr.ef); \
+        type value; \
+        _ef_enter(ptr.ef); \
+        _read_from_array_to(base_ptr, index, &value); \
+        _ef_leave(ptr.ef); \
         return value; \
     } \
     \
@@ -125,47 +211,158 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
+        _ef_enter(ptr.ef); \
         _read_values_from_array(base_ptr, out_array, size, start_index, end_index); \
-        _ef_unlock(ptr.ef); \
+        _ef_leave(ptr.ef); \
     } \
     \
     void _write_##type(_ptr_##type ptr, type value) { \
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
+        _ef_enter(ptr.ef); \
         _write(base_ptr, &value); \
-        _ef_unlock(ptr.ef); \
+        _ef_leave(ptr.ef); \
     } \
     \
     void _write_to_array_##type(_ptr_##type ptr, unsigned int index, type value) { \
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
+        _ef_enter(ptr.ef); \
         _write_to_array(base_ptr, index, &value); \
-        _ef_unlock(ptr.ef); \
+        _ef_leave(ptr.ef); \
     } \
     \
     void _write_values_to_array_##type(_ptr_##type ptr, type values[], unsigned int size, unsigned int start_index, unsigned int end_index) { \
         data_pointer base_ptr; \
         base_ptr.key = ptr.key; \
         base_ptr.tid = ptr.tid; \
-        _ef_lock(ptr.ef); \
+        _ef_enter(ptr.ef); \
         _write_values_to_array(base_ptr, values, size, start_index, end_index); \
-        _ef_unlock(ptr.ef); \
+        _ef_leave(ptr.ef); \
+    } \
+    \
+    type* _pin_##type(_ptr_##type ptr) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        type* data = (type*)_pin(base_ptr); \
+        if (data == NULL) { \
+            _ef_leave(ptr.ef); \
+        } \
+        return data; \
+    } \
+    \
+    void _unpin_##type(_ptr_##type ptr) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _unpin(base_ptr); \
+        _ef_leave(ptr.ef); \
+    } \
+    \
+    int _resize_##type(_ptr_##type ptr, unsigned int size) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        int result = _resize(base_ptr, size); \
+        _ef_leave(ptr.ef); \
+        return result; \
+    } \
+    \
+    int _reserve_##type(_ptr_##type ptr, unsigned int capacity) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        int result = _reserve(base_ptr, capacity); \
+        _ef_leave(ptr.ef); \
+        return result; \
+    } \
+    \
+    int _push_back_##type(_ptr_##type ptr, type value) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        int result = _push_back(base_ptr, &value); \
+        _ef_leave(ptr.ef); \
+        return result; \
+    }
+
+#define data_ptr_implementation(type) \
+    _data_ptr_implementation(type, _allocate_array_in, NULL, NULL, NULL)
+
+// 1 if the type is one of the integer types atomic_fetch_add accepts, 0 otherwise
+#define _is_atomic_integer(type) \
+    _Generic((type *)0, \
+        char *: 1, signed char *: 1, unsigned char *: 1, \
+        short *: 1, unsigned short *: 1, \
+        int *: 1, unsigned int *: 1, \
+        long *: 1, unsigned long *: 1, \
+        long long *: 1, unsigned long long *: 1, \
+        default: 0)
+
+// Integer types only, the operations are C11 atomics made in place on the first element
+#define data_ptr_atomic_implementation(type) \
+    _data_ptr_implementation(type, _allocate_atomic_array_in, _fetch_add_##type, _exchange_##type, _compare_exchange_##type) \
+    \
+    _Static_assert(_is_atomic_integer(type), "atomic data_ptr elements must be integers"); \
+    \
+    type _fetch_add_##type(_ptr_##type ptr, type value) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        _Atomic type* target = (_Atomic type*)_atomic_target(base_ptr, sizeof(type)); \
+        type previous = target != NULL ? atomic_fetch_add(target, value) : 0; \
+        _ef_leave(ptr.ef); \
+        return previous; \
+    } \
+    \
+    type _exchange_##type(_ptr_##type ptr, type value) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        _Atomic type* target = (_Atomic type*)_atomic_target(base_ptr, sizeof(type)); \
+        type previous = target != NULL ? atomic_exchange(target, value) : 0; \
+        _ef_leave(ptr.ef); \
+        return previous; \
+    } \
+    \
+    int _compare_exchange_##type(_ptr_##type ptr, type* expected, type desired) { \
+        data_pointer base_ptr; \
+        base_ptr.key = ptr.key; \
+        base_ptr.tid = ptr.tid; \
+        _ef_enter(ptr.ef); \
+        _Atomic type* target = (_Atomic type*)_atomic_target(base_ptr, sizeof(type)); \
+        int result = target == NULL ? -1 : atomic_compare_exchange_strong(target, expected, desired); \
+        _ef_leave(ptr.ef); \
+        return result; \
     }
 
 #define define_data_ptr(type) \
     data_ptr_definion(type) \
     data_ptr_implementation(type)
 
+#define define_atomic_data_ptr(type) \
+    data_ptr_definion(type) \
+    data_ptr_atomic_implementation(type)
+
 #define data_ptr(type) _ptr_##type
 
 #define NULLPTR(type) \
     (data_ptr(type)){.key = 0, .tid = 0, .functions = NULL, .ef = NULL}
 
+#define IS_NULLPTR(ptr) ((ptr).tid == 0)
+
+#define base_ptr(ptr) ((data_pointer){.key = (ptr).key, .tid = (ptr).tid})
+
+// NULLPTR(type) if the memory is exhausted, check with IS_NULLPTR
 #define allocate(type, ef) _allocate_##type(ef)
 #define allocate_array(type, size, ef) _allocate_array_##type(size, ef)
 
@@ -183,7 +380,41 @@ void _write_values_to_array(data_pointer ptr, void* values, unsigned int size, u
 #define write_values_to_array_start(ptr, values, size, start_index) ptr.functions->write_values_to_array(ptr, values, size, start_index, size)
 #define write_all_values_to_array(ptr, values, size) ptr.functions->write_values_to_array(ptr, values, size, 0, size)
 
+// Growable arrays, return 1 on success and 0 otherwise. A pinned array can only change within its reserved capacity.
+#define resize(ptr, size) ptr.functions->resize(ptr, size)
+#define reserve(ptr, capacity) ptr.functions->reserve(ptr, capacity)
+#define push_back(ptr, value) ptr.functions->push_back(ptr, value)
+
+// Lock-free updates of the first element, for the types defined with define_atomic_data_ptr. They are atomic with
+// respect to each other, not to write_value, and the allocation must not be released or resized meanwhile.
+// fetch_add_value and exchange_value return the previous value, 0 if there is no such allocation.
+// compare_exchange_value returns 1 if the value was expected and is replaced, otherwise 0 and expected is updated,
+// or -1 if there is no such allocation, expected is left as is then.
+// The processes of a vic update the same memory: without the shared heap (vic_use_shared_heap) the atomic types
+// are allocated in a heap mapped MAP_SHARED on the first of them, which the transformations leave in place.
+#define fetch_add_value(ptr, value) ptr.functions->fetch_add(ptr, value)
+#define exchange_value(ptr, value) ptr.functions->exchange(ptr, value)
+#define compare_exchange_value(ptr, expected, desired) ptr.functions->compare_exchange(ptr, expected, desired)
+
+// Borrow the elements of the allocation in place, for loops that would otherwise copy them one by one.
+// The pointer stays valid until vic_unpin, which must be called by the same thread, once for each successful vic_pin.
+// The vic of the execution flow is not transformed while an allocation is pinned, so the pin must be short
+// and the thread must not start a transformation itself before unpinning. Returns NULL if there is no such allocation.
+#define vic_pin(ptr) ptr.functions->pin(ptr)
+#define vic_unpin(ptr) ptr.functions->unpin(ptr)
+
 void export_dynamic_data(char* filename);
 void import_dynamic_data(char* filename);
 
+// Apply many snapshots at once on a pool of threads, as many as the processors. The snapshots must not change
+// the same allocation: the order in which they are applied is not defined.
+void import_dynamic_data_parallel(char** filenames, int count);
+
+// Incremental snapshots: the writes made after clear_dynamic_data_changes are tracked per allocation,
+// and export_dynamic_data_changes only writes the allocations changed since. import_dynamic_data applies
+// either kind of snapshot on top of the registry, so the importer must hold the base the changes were made on.
+// Writes through the pointers returned by _read and _read_from_array are not tracked.
+void clear_dynamic_data_changes();
+void export_dynamic_data_changes(char* filename);
+
 #endif
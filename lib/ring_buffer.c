@@ -0,0 +1,194 @@
+#include "ring_buffer.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_BUFFER_MASK (RING_BUFFER_CAPACITY - 1)
+
+#define RING_BUFFER_SPIN_LIMIT 1024
+
+// The ring is the bounded queue of Dmitry Vyukov: every cell carries a sequence number,
+// so producers and the consumer only synchronise on the cell they are working with.
+
+ring_message_t *ring_message_alloc(size_t size)
+{
+    ring_message_t *message = malloc(sizeof(ring_message_t) + size);
+    atomic_init(&message->references, 1);
+    message->flags = 0;
+    message->size = size;
+    return message;
+}
+
+ring_message_t *ring_message_new(const void *data, size_t size)
+{
+    ring_message_t *message = ring_message_alloc(size);
+    memcpy(message->data, data, size);
+    return message;
+}
+
+void ring_message_release(ring_message_t *message)
+{
+    if (message != NULL && atomic_fetch_sub(&message->references, 1) == 1)
+    {
+        free(message);
+    }
+}
+
+void ring_buffer_init(ring_buffer_t *ring, bool multi_producer)
+{
+    for (size_t i = 0; i < RING_BUFFER_CAPACITY; i++)
+    {
+        atomic_init(&ring->cells[i].sequence, i);
+        ring->cells[i].message = NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->multi_producer = multi_producer;
+    atomic_init(&ring->multi_consumer, false);
+}
+
+void ring_buffer_destroy(ring_buffer_t *ring)
+{
+    ring_message_t *message = NULL;
+    while ((message = ring_buffer_pop(ring)) != NULL)
+    {
+        ring_message_release(message);
+    }
+}
+
+void ring_buffer_reset(ring_buffer_t *ring)
+{
+    bool multi_consumer = atomic_load_explicit(&ring->multi_consumer, memory_order_relaxed);
+    ring_buffer_init(ring, ring->multi_producer);
+    atomic_store_explicit(&ring->multi_consumer, multi_consumer, memory_order_relaxed);
+}
+
+bool ring_buffer_push(ring_buffer_t *ring, ring_message_t *message)
+{
+    ring_buffer_cell_t *cell = NULL;
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;)
+    {
+        cell = &ring->cells[position & RING_BUFFER_MASK];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0)
+        {
+            if (!ring->multi_producer)
+            {
+                atomic_store_explicit(&ring->tail, position + 1, memory_order_relaxed);
+                break;
+            }
+
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // The consumer has not released the cell yet, so the ring is full
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->message = message;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    return true;
+}
+
+ring_message_t *ring_buffer_pop(ring_buffer_t *ring)
+{
+    // Set by the producer while the consumer may be popping, the pops started afterwards claim the cells with CAS
+    bool multi_consumer = atomic_load_explicit(&ring->multi_consumer, memory_order_acquire);
+
+    ring_buffer_cell_t *cell = NULL;
+    size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    for (;;)
+    {
+        cell = &ring->cells[position & RING_BUFFER_MASK];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if (difference == 0)
+        {
+            if (!multi_consumer)
+            {
+                atomic_store_explicit(&ring->head, position + 1, memory_order_relaxed);
+                break;
+            }
+
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    ring_message_t *message = cell->message;
+    cell->message = NULL;
+
+    atomic_store_explicit(&cell->sequence, position + RING_BUFFER_CAPACITY, memory_order_release);
+
+    return message;
+}
+
+size_t ring_buffer_size(ring_buffer_t *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail > head ? tail - head : 0;
+}
+
+bool ring_buffer_empty(ring_buffer_t *ring)
+{
+    size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_buffer_cell_t *cell = &ring->cells[position & RING_BUFFER_MASK];
+
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    return (intptr_t)sequence - (intptr_t)(position + 1) < 0;
+}
+
+bool ring_buffer_full(ring_buffer_t *ring)
+{
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_buffer_cell_t *cell = &ring->cells[position & RING_BUFFER_MASK];
+
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    return (intptr_t)sequence - (intptr_t)position < 0;
+}
+
+void ring_buffer_backoff(unsigned int *spins)
+{
+    if (*spins < RING_BUFFER_SPIN_LIMIT)
+    {
+        (*spins)++;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        atomic_signal_fence(memory_order_seq_cst);
+#endif
+        return;
+    }
+
+    sched_yield();
+}
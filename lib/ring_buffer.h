@@ -0,0 +1,70 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Must be a power of two
+#define RING_BUFFER_CAPACITY 1024
+
+#define RING_BUFFER_CACHE_LINE 64
+
+// Message passed through a ring, the payload is stored right after the header
+typedef struct ring_message_t {
+    atomic_int references; // Number of consumers still holding the message, a broadcast shares it between rings
+    unsigned int flags;    // Kind of message, left to the user of the ring, 0 when allocated
+    size_t size;           // Size of the payload in bytes
+    unsigned char data[];  // The payload
+} ring_message_t;
+
+typedef struct ring_buffer_cell_t {
+    atomic_size_t sequence;  // Position of the cell the producers and the consumer are waiting for
+    ring_message_t *message; // The message stored in the cell
+} ring_buffer_cell_t;
+
+// Bounded lock-free queue with one (SPSC) or several (MPSC) producers.
+// A producer may also drop the oldest message, the consumers then claim cells with CAS too.
+typedef struct ring_buffer_t {
+    alignas(RING_BUFFER_CACHE_LINE) atomic_size_t head; // Position of the next message to pop
+    alignas(RING_BUFFER_CACHE_LINE) atomic_size_t tail; // Position of the next message to push
+    alignas(RING_BUFFER_CACHE_LINE) bool multi_producer; // true if producers have to claim cells with CAS
+    atomic_bool multi_consumer;                          // true if the messages may be popped by a producer as well
+
+    ring_buffer_cell_t cells[RING_BUFFER_CAPACITY];
+} ring_buffer_t;
+
+// Allocate a message with one reference and an uninitialised payload
+ring_message_t *ring_message_alloc(size_t size);
+
+ring_message_t *ring_message_new(const void *data, size_t size);
+
+// Drop one reference, the message is freed with the last one
+void ring_message_release(ring_message_t *message);
+
+void ring_buffer_init(ring_buffer_t *ring, bool multi_producer);
+
+// Free all the messages left in the ring
+void ring_buffer_destroy(ring_buffer_t *ring);
+
+// Forget all the messages left in the ring without freeing them
+void ring_buffer_reset(ring_buffer_t *ring);
+
+// Returns false if the ring is full
+bool ring_buffer_push(ring_buffer_t *ring, ring_message_t *message);
+
+// Returns NULL if the ring is empty, must be called by the single consumer only unless multi_consumer is set
+ring_message_t *ring_buffer_pop(ring_buffer_t *ring);
+
+// Number of messages in the ring, may be outdated as soon as it is returned
+size_t ring_buffer_size(ring_buffer_t *ring);
+
+bool ring_buffer_empty(ring_buffer_t *ring);
+
+bool ring_buffer_full(ring_buffer_t *ring);
+
+// Busy-wait step for a producer or a consumer waiting on the ring, yields the cpu after a while
+void ring_buffer_backoff(unsigned int *spins);
+
+#endif
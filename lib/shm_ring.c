@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+
+#include "shm_ring.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define SHM_RING_SPIN_LIMIT 1024
+
+#define SHM_RECORD_ALIGN sizeof(shm_record_t)
+
+static size_t _shm_ring_size(size_t capacity)
+{
+    return sizeof(shm_ring_t) + capacity;
+}
+
+// Every record starts on a multiple of the header size, so a header never wraps around
+static size_t _shm_record_footprint(size_t size)
+{
+    return sizeof(shm_record_t) + ((size + SHM_RECORD_ALIGN - 1) & ~(SHM_RECORD_ALIGN - 1));
+}
+
+static void _shm_ring_init(shm_ring_t *ring, size_t capacity)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->space_sequence, 0);
+    atomic_init(&ring->producer_waiting, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->data_sequence, 0);
+    atomic_init(&ring->consumer_waiting, 0);
+    atomic_init(&ring->messages_written, 0);
+    atomic_init(&ring->messages_released, 0);
+    ring->read = 0;
+    atomic_flag_clear(&ring->release_lock);
+    ring->capacity = capacity;
+}
+
+static void _shm_futex_wait(atomic_uint *word, unsigned int value, int timeout_ms)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+
+    // Not FUTEX_PRIVATE_FLAG: the word is shared between processes
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void _shm_futex_wake(atomic_uint *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void _shm_ring_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+static void _shm_ring_wait(atomic_uint *sequence, atomic_uint *waiting, unsigned int seen, unsigned int *spins, int timeout_ms)
+{
+    if (*spins < SHM_RING_SPIN_LIMIT)
+    {
+        (*spins)++;
+        _shm_ring_pause();
+        return;
+    }
+
+    atomic_fetch_add(waiting, 1);
+    if (atomic_load(sequence) == seen)
+    {
+        _shm_futex_wait(sequence, seen, timeout_ms);
+    }
+    atomic_fetch_sub(waiting, 1);
+}
+
+static void _shm_ring_notify(atomic_uint *sequence, atomic_uint *waiting)
+{
+    atomic_fetch_add(sequence, 1);
+    if (atomic_load(waiting) > 0)
+    {
+        _shm_futex_wake(sequence);
+    }
+}
+
+void *shm_ring_pair_new(const char *name, size_t capacity, shm_ring_t **first, shm_ring_t **second)
+{
+    size_t ring_size = _shm_ring_size(capacity);
+
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("memfd_create");
+        return NULL;
+    }
+
+    if (ftruncate(fd, 2 * ring_size) == -1)
+    {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, 2 * ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    // The mapping keeps the memfd alive, the children inherit it through fork
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    *first = (shm_ring_t *)mapping;
+    *second = (shm_ring_t *)((char *)mapping + ring_size);
+
+    _shm_ring_init(*first, capacity);
+    _shm_ring_init(*second, capacity);
+
+    return mapping;
+}
+
+void shm_ring_pair_destroy(void *mapping, size_t capacity)
+{
+    munmap(mapping, 2 * _shm_ring_size(capacity));
+}
+
+size_t shm_ring_max_fragment(shm_ring_t *ring)
+{
+    return ring->capacity / 4;
+}
+
+void *shm_ring_try_reserve(shm_ring_t *ring, size_t size, bool more)
+{
+    size_t footprint = _shm_record_footprint(size);
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    size_t free_space = ring->capacity - (tail - head);
+    size_t offset = tail & (ring->capacity - 1);
+    size_t contiguous = ring->capacity - offset;
+
+    size_t padding = contiguous < footprint ? contiguous : 0;
+    if (free_space < padding + footprint)
+    {
+        return NULL;
+    }
+
+    if (padding)
+    {
+        shm_record_t *padding_record = (shm_record_t *)(ring->data + offset);
+        padding_record->size = padding - sizeof(shm_record_t);
+        padding_record->flags = SHM_RECORD_PADDING;
+        offset = 0;
+    }
+
+    shm_record_t *record = (shm_record_t *)(ring->data + offset);
+    record->size = size;
+    record->flags = more ? SHM_RECORD_MORE : 0;
+
+    return record + 1;
+}
+
+void shm_ring_commit(shm_ring_t *ring, void *payload)
+{
+    shm_record_t *record = (shm_record_t *)payload - 1;
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & (ring->capacity - 1);
+
+    // The record was placed at the start of the ring if the end was too short for it
+    size_t padding = (unsigned char *)record == ring->data + offset ? 0 : ring->capacity - offset;
+
+    if (!(record->flags & SHM_RECORD_MORE))
+    {
+        atomic_fetch_add_explicit(&ring->messages_written, 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&ring->tail, tail + padding + _shm_record_footprint(record->size), memory_order_release);
+    _shm_ring_notify(&ring->data_sequence, &ring->consumer_waiting);
+}
+
+bool shm_ring_try_write(shm_ring_t *ring, const void *data, size_t size, bool more)
+{
+    void *payload = shm_ring_try_reserve(ring, size, more);
+    if (payload == NULL)
+    {
+        return false;
+    }
+
+    memcpy(payload, data, size);
+    shm_ring_commit(ring, payload);
+
+    return true;
+}
+
+shm_record_t *shm_ring_read(shm_ring_t *ring)
+{
+    for (;;)
+    {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->read == tail)
+        {
+            return NULL;
+        }
+
+        shm_record_t *record = (shm_record_t *)(ring->data + (ring->read & (ring->capacity - 1)));
+        ring->read += _shm_record_footprint(record->size);
+
+        if (record->flags & SHM_RECORD_PADDING)
+        {
+            shm_ring_release(ring, record);
+            continue;
+        }
+
+        return record;
+    }
+}
+
+void shm_ring_release(shm_ring_t *ring, shm_record_t *record)
+{
+    uint64_t flags = atomic_fetch_or_explicit(&record->flags, SHM_RECORD_RELEASED, memory_order_release);
+    if (!(flags & (SHM_RECORD_PADDING | SHM_RECORD_MORE)))
+    {
+        atomic_fetch_add_explicit(&ring->messages_released, 1, memory_order_relaxed);
+    }
+
+    // The records are walked under the lock, so two releasers never store an older head over a newer one.
+    // The producer has written every record up to tail, none of them after read is released yet.
+    while (atomic_flag_test_and_set_explicit(&ring->release_lock, memory_order_acquire))
+    {
+        _shm_ring_pause();
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t new_head = head;
+
+    while (new_head != tail)
+    {
+        shm_record_t *current = (shm_record_t *)(ring->data + (new_head & (ring->capacity - 1)));
+        if (!(atomic_load_explicit(&current->flags, memory_order_acquire) & SHM_RECORD_RELEASED))
+        {
+            break;
+        }
+
+        new_head += _shm_record_footprint(current->size);
+    }
+
+    if (new_head != head)
+    {
+        atomic_store_explicit(&ring->head, new_head, memory_order_release);
+    }
+
+    atomic_flag_clear_explicit(&ring->release_lock, memory_order_release);
+
+    if (new_head != head)
+    {
+        _shm_ring_notify(&ring->space_sequence, &ring->producer_waiting);
+    }
+}
+
+bool shm_ring_empty(shm_ring_t *ring)
+{
+    return ring->read == atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+size_t shm_ring_size(shm_ring_t *ring)
+{
+    size_t released = atomic_load_explicit(&ring->messages_released, memory_order_relaxed);
+    size_t written = atomic_load_explicit(&ring->messages_written, memory_order_relaxed);
+    return written > released ? written - released : 0;
+}
+
+bool shm_ring_full(shm_ring_t *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    // The worst case is a padding record followed by an empty record
+    return ring->capacity - (tail - head) < 2 * sizeof(shm_record_t);
+}
+
+unsigned int shm_ring_data_sequence(shm_ring_t *ring)
+{
+    return atomic_load(&ring->data_sequence);
+}
+
+unsigned int shm_ring_space_sequence(shm_ring_t *ring)
+{
+    return atomic_load(&ring->space_sequence);
+}
+
+void shm_ring_wait_data(shm_ring_t *ring, unsigned int seen, unsigned int *spins, int timeout_ms)
+{
+    _shm_ring_wait(&ring->data_sequence, &ring->consumer_waiting, seen, spins, timeout_ms);
+}
+
+void shm_ring_wait_space(shm_ring_t *ring, unsigned int seen, unsigned int *spins, int timeout_ms)
+{
+    _shm_ring_wait(&ring->space_sequence, &ring->producer_waiting, seen, spins, timeout_ms);
+}
@@ -0,0 +1,92 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Capacity of one direction of a link in bytes, must be a power of two.
+// Only the touched pages of the memfd are backed by memory.
+#define SHM_RING_CAPACITY (1 << 22)
+
+#define SHM_RING_CACHE_LINE 64
+
+// Number of messages queued in a ring before the producer waits, same as the default high-water mark of zmq
+#define SHM_RING_DEFAULT_HWM 1000
+
+#define SHM_RECORD_PADDING 0x01  // The record only fills the end of the ring
+#define SHM_RECORD_MORE 0x02     // More fragments of the same message follow
+#define SHM_RECORD_RELEASED 0x04 // The consumer is done with the record
+#define SHM_RECORD_CALL 0x08     // Every fragment of a call of vic_ef_call carries it, the plain messages do not
+
+// The first fragment of a split message may carry the size of the whole message in the flags, above this bit
+#define SHM_RECORD_MESSAGE_SHIFT 8
+
+// Header of a record in the ring, the payload is stored right after it
+typedef struct shm_record_t {
+    uint64_t size;  // Size of the payload in bytes
+    _Atomic uint64_t flags; // SHM_RECORD_* flags, released by any thread of the consumer
+} shm_record_t;
+
+// Single producer single consumer ring of variable sized records placed in shared memory,
+// so the producer and the consumer may live in different processes
+typedef struct shm_ring_t {
+    alignas(SHM_RING_CACHE_LINE) atomic_size_t head; // Offset of the first record not released by the consumer
+    atomic_uint space_sequence;                      // Incremented each time the consumer frees space
+    atomic_uint producer_waiting;                    // Number of producers sleeping on space_sequence
+
+    alignas(SHM_RING_CACHE_LINE) atomic_size_t tail; // Offset of the end of the last written record
+    atomic_uint data_sequence;                       // Incremented each time the producer writes a record
+    atomic_uint consumer_waiting;                    // Number of consumers sleeping on data_sequence
+    atomic_size_t messages_written;                  // Number of complete messages written by the producer
+    atomic_size_t messages_released;                 // Number of complete messages released by the consumer
+
+    alignas(SHM_RING_CACHE_LINE) size_t read; // Offset of the next record to read, used by the consumer only
+    atomic_flag release_lock;                 // Serialises the moves of head by the threads releasing records
+    size_t capacity;                          // Size of the data area in bytes
+
+    alignas(SHM_RING_CACHE_LINE) unsigned char data[];
+} shm_ring_t;
+
+// Map a memfd holding the two rings of a link, the mapping is shared with the children forked afterwards
+void *shm_ring_pair_new(const char *name, size_t capacity, shm_ring_t **first, shm_ring_t **second);
+
+void shm_ring_pair_destroy(void *mapping, size_t capacity);
+
+// Largest payload written as a single record, bigger messages are split into fragments
+size_t shm_ring_max_fragment(shm_ring_t *ring);
+
+// Reserve one record and return where its payload goes, returns NULL if there is not enough space in the ring.
+// The consumer does not see the record until it is passed to shm_ring_commit, before any other reservation.
+void *shm_ring_try_reserve(shm_ring_t *ring, size_t size, bool more);
+
+void shm_ring_commit(shm_ring_t *ring, void *payload);
+
+// Write one record, returns false if there is not enough space in the ring
+bool shm_ring_try_write(shm_ring_t *ring, const void *data, size_t size, bool more);
+
+// Read the next record without copying it, returns NULL if the ring is empty.
+// The record stays valid until it is passed to shm_ring_release.
+shm_record_t *shm_ring_read(shm_ring_t *ring);
+
+// Give the space of a record back to the producer, records may be released in any order and by several threads at once
+void shm_ring_release(shm_ring_t *ring, shm_record_t *record);
+
+bool shm_ring_empty(shm_ring_t *ring);
+
+// Number of messages written but not released yet
+size_t shm_ring_size(shm_ring_t *ring);
+
+// Returns true if not even an empty record can be written without waiting
+bool shm_ring_full(shm_ring_t *ring);
+
+unsigned int shm_ring_data_sequence(shm_ring_t *ring);
+unsigned int shm_ring_space_sequence(shm_ring_t *ring);
+
+// Spin for a while and then sleep on a futex until the sequence differs from seen or the timeout expires
+void shm_ring_wait_data(shm_ring_t *ring, unsigned int seen, unsigned int *spins, int timeout_ms);
+void shm_ring_wait_space(shm_ring_t *ring, unsigned int seen, unsigned int *spins, int timeout_ms);
+
+#endif
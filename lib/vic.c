@@ -1,8 +1,11 @@
+// Before any include, the feature macros of glibc are fixed by the first header
+#define _GNU_SOURCE
+
 #include "vic.h"
 
 #include "pause_thread.h"
-
-#define _GNU_SOURCE
+#include "ring_buffer.h"
+#include "shm_ring.h"
 
 #include "features.h"
 #include "pthread.h"
@@ -10,7 +13,9 @@
 
 #include <string.h>
 #include <czmq.h>
+#include <tpl.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include <sys/resource.h>
 
@@ -23,15 +28,151 @@ data_ptr_implementation(char)
 
 #define WAIT_TIMEOUT 3
 
-// Structure representing a link between two virtual isolation contexts
+// How often a sleeping sender or receiver of a local link checks that the link still uses the same transport
+#define LOCAL_WAIT_TIMEOUT_MS 100
+
+// Longest time a socket is kept locked while waiting to receive: the other links of a multiplexed socket
+// and the transformations, which wait for the operations of the execution flow to finish, wait for it
+#define MUX_WAIT_SLICE_MS 5
+
+// Before a transformation the sockets are drained until nothing arrived for SPILL_QUIET_PASSES slices of SPILL_SLICE_MS,
+// the messages still sent after SPILL_MAX_MS are lost
+#define SPILL_SLICE_MS 5
+#define SPILL_QUIET_PASSES 2
+#define SPILL_MAX_MS 1000
+
+// Number of execution flows a thread can be inside the operations of at the same time
+#define EF_DEPTH_SLOTS 8
+
+// Flag of the ring messages carrying a call, the shared memory records use SHM_RECORD_CALL
+#define MESSAGE_CALL 0x01
+
+// Pair of rings shared by both ends of a link, one ring per direction
+typedef struct
+{
+    ring_buffer_t rings[2];
+    atomic_int references; // Number of link ends still using the channel
+} _vic_ring_channel_t;
+
+// Memfd mapping holding the two shared memory rings of a link
+typedef struct
+{
+    void *mapping;
+    atomic_int references; // Number of link ends still using the mapping in this process
+} _vic_shm_channel_t;
+
+typedef cc_list(char *) _vic_topic_list_t;
+
+typedef cc_list(struct _vic_link_t *) _vic_subscriber_list_t;
+
+// Subscribers of a broadcast link, shared by all the ends of the link
+typedef struct
+{
+    pthread_mutex_t lock;               // Protects the subscribers and their topics
+    _vic_subscriber_list_t subscribers; // The subscriber ends the publisher pushes to when the rings are used
+    atomic_int references;              // Number of link ends still using the group
+} _vic_broadcast_t;
+
+enum _vic_call_kind_t
+{
+    CALL_PLAIN = 0, // Not a call, a message of vic_ef_send*
+    CALL_REQUEST = 1,
+    CALL_REPLY = 2
+};
+
+// Header in front of the payload of the requests and the replies. The transports mark the calls out of band:
+// a flag on the ring message or the shared memory records, a frame of its own on zmq.
+typedef struct
+{
+    uint64_t id;   // Correlation id chosen by the calling end
+    uint64_t kind; // CALL_REQUEST or CALL_REPLY
+} _vic_call_header_t;
+
+// Call received before the execution flow asked for it
+typedef struct
+{
+    uint64_t id;       // The correlation id of the call
+    vic_frame_t frame; // The payload of the call, after the call header
+} _vic_call_t;
+
+typedef cc_list(_vic_call_t) _vic_call_list_t;
+
+typedef cc_map(uint64_t, vic_frame_t) _vic_reply_map_t;
+
+typedef cc_list(zframe_t *) _vic_zframe_list_t;
+
+typedef cc_list(ring_message_t *) _vic_message_list_t;
+
+typedef cc_map(uint32_t, struct _vic_link_t *) _vic_channel_map_t;
+
+// Socket shared by all the links between a vic and one peer, each message is preceded by the channel id of its link
 typedef struct
 {
+    pthread_mutex_t lock;        // Serialises the users of the socket
+    vic_t *peer;                 // The vic at the other end of the socket
+    char *name;                  // Name of the socket, replaces the name of the links in the address
+    char *addr;                  // The full address of the socket (prefix of the links + name)
+    int zmq_type;                // The type of the zmq socket
+    int bind;                    // 1 if the socket is bound, 0 if the socket is connected
+    zsock_t *sock;               // The socket, NULL while it is not established
+    uint32_t next_channel;       // Channel id of the next link made with the peer
+    _vic_channel_map_t channels; // The links of the vic by channel id
+    atomic_int references;       // Number of links of the vic using the socket
+} _vic_mux_t;
+
+// Role of a link end
+enum _vic_link_role_t
+{
+    LINK_PAIR = 0,      // One end of a point-to-point link
+    LINK_PUBLISHER = 1, // The publishing end of a broadcast link
+    LINK_SUBSCRIBER = 2 // A subscribing end of a broadcast link
+};
+
+// Structure representing a link between two virtual isolation contexts
+typedef struct _vic_link_t
+{
+    char *name; // The name of the link as passed to vic_link
+
+    pthread_mutex_t lock; // Serialises the users of the zmq socket and of the receiving side of the rings
+
     int zmq_type;               // The type of the zmq socket
     char *zmq_transport_prefix; // The transport prefix of the zmq socket
     char *zmq_addr;             // The full address of the zmq socket (prefix + name)
 
     zsock_t *zmq_sock; // The zmq socket
     int zmq_bind;      // 1 if the socket is bound, 0 if the socket is connected
+
+    _vic_ring_channel_t *ring_channel; // The rings shared with the other end of the link
+    ring_buffer_t *ring_tx;            // The ring used to send messages to the other end
+    ring_buffer_t *ring_rx;            // The ring used to receive messages from the other end
+    int ring;                          // 1 if the rings are used instead of the zmq socket
+
+    _vic_shm_channel_t *shm_channel; // The shared memory rings inherited by the forked processes
+    shm_ring_t *shm_tx;              // The shared memory ring used to send messages to the other end
+    shm_ring_t *shm_rx;              // The shared memory ring used to receive messages from the other end
+    int shm;                         // 1 if the shared memory rings are used instead of the zmq socket
+
+    int send_hwm;                  // Maximum number of queued outgoing messages, 0 keeps the default of the transport
+    int recv_hwm;                  // Maximum number of queued incoming messages of the zmq socket, 0 keeps the default
+    enum vic_link_policy_t policy; // What a send does when the queue of the link is full
+
+    enum _vic_link_role_t role;  // Point-to-point or broadcast end
+    _vic_broadcast_t *broadcast; // The subscribers of a broadcast link
+    _vic_topic_list_t topics;    // Topic prefixes a subscriber end receives
+
+    pthread_mutex_t call_lock; // Protects the calls received but not collected yet
+    pthread_cond_t call_cond;  // Signalled each time the receiving waiter stores a call or stops receiving
+    bool call_receiving;       // true while one waiter receives the calls on behalf of all the others
+    uint64_t call_id;          // Last correlation id used by this end
+    _vic_reply_map_t replies;  // Replies received before they were waited for, by correlation id
+    _vic_call_list_t requests; // Requests received while waiting for a reply, in arrival order
+
+    _vic_mux_t *mux;              // The socket shared with the other links to the same vic, NULL if the link has its own
+    uint32_t channel;             // Id of the link on the shared socket
+    _vic_zframe_list_t mux_inbox; // Messages of the link received by another user of the shared socket
+
+    _vic_message_list_t spill; // Messages received before a transformation switched the transport, served first
+    _vic_message_list_t plain; // Plain messages received by a call waiter, served first to the other receives
 } _vic_link_t;
 
 typedef cc_list(_vic_link_t) _vic_link_list_t;
@@ -45,6 +186,10 @@ enum _wait_result_t
 struct _vic_t
 {
     enum vic_abstraction_t abstraction; // The abstraction of the virtual isolation context
+    int socket_flags;                   // VIC_SOCKETS_* flags set with vic_set_socket_flags
+    pthread_t socket_thread;            // The thread establishing the sockets in the background
+    bool socket_thread_running;         // true until the socket thread is joined
+    atomic_int socket_thread_stop;      // Set to make the socket thread return early
     void *data;                         // Pointer to the data that the virtual isolation context will use
     vic_ef_t *ef;                       // Pointer to the root execution flow of the virtual isolation context (must be one-to-one only)
 
@@ -59,8 +204,12 @@ struct _vic_t
 // Structure representing an execution flow
 struct _vic_ef_t
 {
-    vic_t *vic;           // Pointer to the virtual isolation context that the execution flow belongs to
-    pthread_mutex_t lock; // Mutex lock for vic transformation
+    vic_t *vic; // Pointer to the virtual isolation context that the execution flow belongs to
+
+    atomic_int active;    // Number of operations of the execution flow in progress
+    atomic_int quiescing; // 1 while a transformation waits for the operations to finish or runs
+
+    unsigned long long region; // Allocation region of the data_ptr allocations made for the execution flow
 
     void (*routine)(vic_t *);  // Pointer to the routine that the execution flow will execute
     void (*finished)(vic_t *); // Pointer to the function that will be called when the execution flow is about to be destroyed
@@ -91,6 +240,16 @@ void _vic_transform_thread_to_process(vic_t *vic, pid_t pid);
 void _vic_transform_process_to_thread(vic_t *vic, pthread_t thread);
 
 void _vic_start_helper(vic_t *vic);
+void _vic_socket_thread_stop(vic_t *vic);
+
+void _ef_quiesce(vic_ef_t *ef);
+void _ef_resume(vic_ef_t *ef);
+
+void _vic_link_lock(vic_ef_t *ef, _vic_link_t *link);
+void _vic_link_unlock(vic_ef_t *ef, _vic_link_t *link);
+
+zframe_t *_vic_recv_frame_helper(vic_ef_t *ef, _vic_link_t *link, zframe_t **header);
+bool _vic_recv_interrupted(vic_ef_t *ef, _vic_link_t *link);
 
 int _get_threads_number()
 {
@@ -165,12 +324,256 @@ void _wait_for_external_signal_or_terminate(zsock_t *socket, const char *signal)
     free(received_signal);
 }
 
+void _vic_mux_drain(_vic_mux_t *mux);
+_vic_link_t *_vic_find_link(vic_t *vic, const char *name);
+
+// Same layout as the publications pushed to the rings by _vic_ring_publish
+ring_message_t *_vic_publication_message(zframe_t *topic, zframe_t *payload)
+{
+    size_t topic_size = zframe_size(topic);
+
+    ring_message_t *message = ring_message_alloc(sizeof(size_t) + topic_size + zframe_size(payload));
+    memcpy(message->data, &topic_size, sizeof(size_t));
+    memcpy(message->data + sizeof(size_t), zframe_data(topic), topic_size);
+    memcpy(message->data + sizeof(size_t) + topic_size, zframe_data(payload), zframe_size(payload));
+
+    return message;
+}
+
+// Same layout as the calls sent through the rings: the header frame followed by the payload, marked as a call
+ring_message_t *_vic_call_message(zframe_t *header, zframe_t *payload)
+{
+    size_t header_size = zframe_size(header);
+
+    ring_message_t *message = ring_message_alloc(header_size + zframe_size(payload));
+    memcpy(message->data, zframe_data(header), header_size);
+    memcpy(message->data + header_size, zframe_data(payload), zframe_size(payload));
+    message->flags = MESSAGE_CALL;
+
+    return message;
+}
+
+// Moves the messages queued in the sockets of the vic to the spill buffers of their links,
+// so closing the sockets for a transformation does not lose them. Returns the number of messages moved.
+int _vic_spill_sockets(vic_t *vic)
+{
+    int moved = 0;
+
+    cc_for_each(&vic->links, link)
+    {
+        if (link->mux != NULL)
+        {
+            _vic_mux_drain(link->mux);
+
+            while (cc_size(&link->mux_inbox) > 0)
+            {
+                zframe_t **first = cc_first(&link->mux_inbox);
+                zframe_t *frame = *first;
+                cc_erase(&link->mux_inbox, first);
+
+                // The header of a call is queued right before its payload
+                if (zframe_more(frame) && cc_size(&link->mux_inbox) > 0)
+                {
+                    zframe_t **next = cc_first(&link->mux_inbox);
+                    cc_push(&link->spill, _vic_call_message(frame, *next));
+                    zframe_destroy(next);
+                    cc_erase(&link->mux_inbox, next);
+                }
+                else
+                {
+                    cc_push(&link->spill, ring_message_new(zframe_data(frame), zframe_size(frame)));
+                }
+
+                zframe_destroy(&frame);
+                moved++;
+            }
+            continue;
+        }
+
+        while (link->zmq_sock != NULL && zsock_events(link->zmq_sock) & ZMQ_POLLIN)
+        {
+            zmsg_t *message = zmsg_recv(link->zmq_sock);
+            if (message == NULL)
+            {
+                break;
+            }
+
+            zframe_t *first = zmsg_first(message);
+            if (link->role == LINK_SUBSCRIBER && zmsg_size(message) == 2)
+            {
+                cc_push(&link->spill, _vic_publication_message(first, zmsg_next(message)));
+            }
+            else if (link->role == LINK_PAIR && zmsg_size(message) == 2)
+            {
+                cc_push(&link->spill, _vic_call_message(first, zmsg_next(message)));
+            }
+            else if (link->role == LINK_PAIR && first != NULL)
+            {
+                cc_push(&link->spill, ring_message_new(zframe_data(first), zframe_size(first)));
+            }
+
+            zmsg_destroy(&message);
+            moved++;
+        }
+    }
+
+    return moved;
+}
+
+// Moves the messages left in the receiving rings of the vic to the spill buffers. Needed when processes are merged:
+// the rings are restarted and the shared memory of a merged process is gone.
+void _vic_spill_local(vic_t *vic)
+{
+    cc_for_each(&vic->links, link)
+    {
+        ring_message_t *message = NULL;
+
+        if (link->shm_rx != NULL)
+        {
+            shm_record_t *record = NULL;
+            while ((record = shm_ring_read(link->shm_rx)) != NULL)
+            {
+                size_t size = message != NULL ? message->size : 0;
+                message = realloc(message, sizeof(ring_message_t) + size + record->size);
+                if (size == 0)
+                {
+                    atomic_init(&message->references, 1);
+                    message->flags = record->flags & SHM_RECORD_CALL ? MESSAGE_CALL : 0;
+                }
+                memcpy(message->data + size, record + 1, record->size);
+                message->size = size + record->size;
+
+                if (!(record->flags & SHM_RECORD_MORE))
+                {
+                    cc_push(&link->spill, message);
+                    message = NULL;
+                }
+
+                shm_ring_release(link->shm_rx, record);
+            }
+
+            // The sender switched transports in the middle of the message and sent it again
+            free(message);
+        }
+
+        while ((message = ring_buffer_pop(link->ring_rx)) != NULL)
+        {
+            cc_push(&link->spill, message);
+        }
+    }
+}
+
+// Drains the sockets of the quiesced vics until the messages already sent stopped arriving
+void _vic_spill_until_quiet(vic_t **vics, int count)
+{
+    int64_t deadline = zclock_mono() + SPILL_MAX_MS;
+    int quiet = 0;
+
+    while (quiet < SPILL_QUIET_PASSES && zclock_mono() < deadline)
+    {
+        int moved = 0;
+        for (int i = 0; i < count; i++)
+        {
+            moved += _vic_spill_sockets(vics[i]);
+        }
+
+        quiet = moved > 0 ? 0 : quiet + 1;
+        if (quiet < SPILL_QUIET_PASSES)
+        {
+            zclock_sleep(SPILL_SLICE_MS);
+        }
+    }
+}
+
+// The spill buffers of a process are written next to its heap, the merged process reads them back
+void _vic_export_spill(vic_t *vic, const char *filename)
+{
+    char *name = NULL;
+    unsigned int flags = 0;
+    tpl_bin tb;
+    tpl_node *tn = tpl_map("A(suB)", &name, &flags, &tb);
+
+    cc_for_each(&vic->links, link)
+    {
+        // The plain messages kept by a call waiter arrived first
+        cc_for_each(&link->plain, message)
+        {
+            name = link->name;
+            flags = (*message)->flags;
+            tb.addr = (*message)->data;
+            tb.sz = (*message)->size;
+            tpl_pack(tn, 1);
+        }
+
+        cc_for_each(&link->spill, message)
+        {
+            name = link->name;
+            flags = (*message)->flags;
+            tb.addr = (*message)->data;
+            tb.sz = (*message)->size;
+            tpl_pack(tn, 1);
+        }
+    }
+
+    tpl_dump(tn, TPL_FILE, filename);
+    tpl_free(tn);
+}
+
+void _vic_import_spill(vic_t *vic, const char *filename)
+{
+    // The copy of the vic in this process still holds the spill of the previous transformation, served by the other process
+    cc_for_each(&vic->links, link)
+    {
+        cc_for_each(&link->spill, message)
+        {
+            ring_message_release(*message);
+        }
+        cc_clear(&link->spill);
+
+        cc_for_each(&link->plain, message)
+        {
+            ring_message_release(*message);
+        }
+        cc_clear(&link->plain);
+    }
+
+    char *name = NULL;
+    unsigned int flags = 0;
+    tpl_bin tb;
+    tpl_node *tn = tpl_map("A(suB)", &name, &flags, &tb);
+
+    if (tpl_load(tn, TPL_FILE, filename) == 0)
+    {
+        while (tpl_unpack(tn, 1) > 0)
+        {
+            _vic_link_t *link = _vic_find_link(vic, name);
+            if (link != NULL)
+            {
+                ring_message_t *message = ring_message_new(tb.addr, tb.sz);
+                message->flags = flags;
+                cc_push(&link->spill, message);
+            }
+
+            free(tb.addr);
+            free(name);
+        }
+    }
+
+    tpl_free(tn);
+}
+
 void _vic_disconnect_links(vic_t *vic)
 {
     cc_for_each(&vic->links, link)
     {
         zsock_destroy(&link->zmq_sock);
         link->zmq_sock = NULL;
+
+        if (link->mux != NULL)
+        {
+            zsock_destroy(&link->mux->sock);
+            link->mux->sock = NULL;
+        }
     }
 }
 
@@ -181,16 +584,21 @@ void perform_transform_threads_to_processes()
     char address[ADDR_BUFFER_LEN] = {};
     snprintf(address, ADDR_BUFFER_LEN, "ipc:///tmp/vic_transform_prepare_%d", getpid());
 
-    pthread_mutex_lock(&main_vic->ef->lock);
-    _vic_disconnect_links(main_vic);
+    vic_t **quiesced = malloc(sizeof(vic_t *) * (cc_size(&vic_list) + 1));
+    int quiesced_count = 0;
+
+    _vic_socket_thread_stop(main_vic);
+    _ef_quiesce(main_vic->ef);
+    quiesced[quiesced_count++] = main_vic;
 
     cc_for_each(&vic_list, vic_ptr)
     {
         vic_t *vic = vic_ptr->vic;
         if (vic->abstraction & EF_THREAD && vic_ptr->executing)
         {
-            pthread_mutex_lock(&vic->ef->lock);
-            _vic_disconnect_links(vic);
+            _vic_socket_thread_stop(vic);
+            _ef_quiesce(vic->ef);
+            quiesced[quiesced_count++] = vic;
         }
         else if (vic->abstraction & EF_PROCESS)
         {
@@ -198,6 +606,18 @@ void perform_transform_threads_to_processes()
         }
     }
 
+    // Nothing is sent anymore, the messages on their way are kept before the sockets are closed
+    _vic_spill_until_quiet(quiesced, quiesced_count);
+
+    for (int i = 0; i < quiesced_count; i++)
+    {
+        _vic_disconnect_links(quiesced[i]);
+    }
+    free(quiesced);
+
+    // The heap at the split is the base of every process: each one exports only what it changes afterwards
+    clear_dynamic_data_changes();
+
     zsys_shutdown();
 
     int current_threads_number = _get_threads_number();
@@ -269,18 +689,18 @@ void perform_transform_threads_to_processes()
 
         if (vic->abstraction & EF_PROCESS && (unsigned int)getpid() != thread_tid)
         {
-            pthread_mutex_unlock(&vic->ef->lock);
+            _ef_resume(vic->ef);
             continue;
         }
 
         _vic_start_helper(vic);
 
-        pthread_mutex_unlock(&vic->ef->lock);
+        _ef_resume(vic->ef);
     }
 
     _vic_transform_thread_to_process(main_vic, main_pid);
     _vic_start_helper(main_vic);
-    pthread_mutex_unlock(&main_vic->ef->lock);
+    _ef_resume(main_vic->ef);
 
     current_abstraction = EF_PROCESS;
 }
@@ -343,7 +763,10 @@ void perform_transform_processes_to_threads()
 
         printf("Locking all locks\n");
 
-        pthread_mutex_lock(&main_vic->ef->lock);
+        _vic_socket_thread_stop(main_vic);
+        _ef_quiesce(main_vic->ef);
+        _vic_spill_until_quiet(&main_vic, 1);
+        _vic_spill_local(main_vic);
         _vic_disconnect_links(main_vic);
 
         cc_list(struct process_transformation_info_t) threads_list;
@@ -354,13 +777,7 @@ void perform_transform_processes_to_threads()
             vic_t *vic = vic_ptr->vic;
             if (vic->abstraction & EF_PROCESS && vic->ef != NULL)
             {
-                if (pthread_mutex_trylock(&vic->ef->lock) == 0)
-                {
-                    continue;
-                }
-
-                pthread_mutex_unlock(&vic->ef->lock);
-                pthread_mutex_lock(&vic->ef->lock);
+                _ef_quiesce(vic->ef);
             }
         }
 
@@ -442,6 +859,35 @@ void perform_transform_processes_to_threads()
 
         printf("Converting\n");
 
+        // The shared heap already holds the allocations of the processes, otherwise their snapshots are applied
+        // together: each process only exported what it changed, so they touch different allocations
+        if (!_dynamic_memory_is_shared())
+        {
+            char **heap_filenames = malloc(sizeof(char *) * (cc_size(&vic_list) + 1));
+            int heap_count = 0;
+
+            cc_for_each(&vic_list, vic_ptr)
+            {
+                vic_t *vic = vic_ptr->vic;
+                if (vic->abstraction & EF_PROCESS)
+                {
+                    heap_filenames[heap_count] = malloc(256);
+                    snprintf(heap_filenames[heap_count], 256, "/tmp/%d-dynamic-data.heap", *(pid_t *)vic->data);
+                    heap_count++;
+                }
+            }
+
+            printf("Importing dynamic data of %d processes\n", heap_count);
+
+            import_dynamic_data_parallel(heap_filenames, heap_count);
+
+            for (int i = 0; i < heap_count; i++)
+            {
+                free(heap_filenames[i]);
+            }
+            free(heap_filenames);
+        }
+
         cc_for_each(&vic_list, vic_ptr)
         {
             vic_t *vic = vic_ptr->vic;
@@ -453,11 +899,8 @@ void perform_transform_processes_to_threads()
             pid_t current_process_pid = *(pid_t *)vic->data;
 
             char filename[256];
-            snprintf(filename, sizeof(filename), "/tmp/%d-dynamic-data.tpl", current_process_pid);
-
-            printf("Importing dynamic data from file: %s\n", filename);
-
-            import_dynamic_data(filename);
+            snprintf(filename, sizeof(filename), "/tmp/%d-link-spill.tpl", current_process_pid);
+            _vic_import_spill(vic, filename);
 
             printf("Converting process to thread\n");
 
@@ -475,7 +918,7 @@ void perform_transform_processes_to_threads()
             {
                 _vic_start_helper(vic);
 
-                pthread_mutex_unlock(&vic->ef->lock);
+                _ef_resume(vic->ef);
             }
         }
 
@@ -489,7 +932,7 @@ void perform_transform_processes_to_threads()
         }
 
         _vic_start_helper(main_vic);
-        pthread_mutex_unlock(&main_vic->ef->lock);
+        _ef_resume(main_vic->ef);
 
         printf("Resumed threads\n");
 
@@ -501,6 +944,7 @@ void perform_transform_processes_to_threads()
     printf("Parent process: %d\n", main_pid);
     printf("Current process: %d\n", process_pid);
     pthread_t process_thread = 0;
+    vic_t *process_vic = NULL;
     cc_for_each(&vic_list, vic_ptr)
     {
         vic_t *vic = vic_ptr->vic;
@@ -509,9 +953,13 @@ void perform_transform_processes_to_threads()
         printf("vic_ptr executing: %d\n", vic_ptr->executing);
         if (vic->abstraction & EF_PROCESS && vic_ptr->tid == (unsigned int)process_pid && vic_ptr->executing)
         {
-            pthread_mutex_lock(&vic->ef->lock);
+            _vic_socket_thread_stop(vic);
+            _ef_quiesce(vic->ef);
+            _vic_spill_until_quiet(&vic, 1);
+            _vic_spill_local(vic);
             _vic_disconnect_links(vic);
             process_thread = vic_ptr->thread;
+            process_vic = vic;
             break;
         }
     }
@@ -534,9 +982,16 @@ void perform_transform_processes_to_threads()
     pthread_resume(process_thread);
 
     char filename[256];
-    snprintf(filename, sizeof(filename), "/tmp/%d-dynamic-data.tpl", process_pid);
 
-    export_dynamic_data(filename);
+    if (!_dynamic_memory_is_shared())
+    {
+        snprintf(filename, sizeof(filename), "/tmp/%d-dynamic-data.heap", process_pid);
+
+        export_dynamic_data_changes(filename);
+    }
+
+    snprintf(filename, sizeof(filename), "/tmp/%d-link-spill.tpl", process_pid);
+    _vic_export_spill(process_vic, filename);
 
     zsock_t *socket = zsock_new(ZMQ_DEALER);
     zsock_bind(socket, address);
@@ -590,6 +1045,9 @@ vic_t *_vic_new()
 {
     vic_t *vic = malloc(sizeof(vic_t));
     vic->abstraction = 0;
+    vic->socket_flags = 0;
+    vic->socket_thread_running = false;
+    atomic_init(&vic->socket_thread_stop, 0);
     vic->data = NULL;
     vic->ef = NULL;
 
@@ -609,10 +1067,16 @@ vic_ef_t *_ef_new()
     ef->routine = NULL;
     ef->finished = NULL;
     ef->vic = NULL;
+    ef->region = 0;
 
     return ef;
 }
 
+int vic_use_shared_heap(size_t size)
+{
+    return _init_shared_dynamic_memory(size);
+}
+
 vic_t *vic_init()
 {
     pthread_pause_enable();
@@ -632,15 +1096,112 @@ vic_t *vic_init()
     return new_main_vic;
 }
 
+// Removes a link end from a broadcast group, so the publisher stops pushing to its ring
+void _vic_broadcast_leave(_vic_broadcast_t *broadcast, _vic_link_t *link)
+{
+    pthread_mutex_lock(&broadcast->lock);
+    _vic_link_t **subscriber = cc_first(&broadcast->subscribers);
+    for (; subscriber != cc_end(&broadcast->subscribers); subscriber = cc_next(&broadcast->subscribers, subscriber))
+    {
+        if (*subscriber == link)
+        {
+            cc_erase(&broadcast->subscribers, subscriber);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+
+    if (atomic_fetch_sub(&broadcast->references, 1) == 1)
+    {
+        pthread_mutex_destroy(&broadcast->lock);
+        cc_cleanup(&broadcast->subscribers);
+        free(broadcast);
+    }
+}
+
 void _vic_destroy_helper(vic_t *vic)
 {
+    _vic_socket_thread_stop(vic);
+
     cc_for_each(&vic->links, link)
     {
+        zstr_free(&link->name);
         zstr_free(&link->zmq_addr);
         zstr_free(&link->zmq_transport_prefix);
 
         if (link->zmq_sock)
             zsock_destroy(&link->zmq_sock);
+
+        pthread_mutex_destroy(&link->lock);
+
+        cc_for_each(&link->replies, reply)
+        {
+            vic_frame_release(reply);
+        }
+        cc_cleanup(&link->replies);
+
+        cc_for_each(&link->requests, request)
+        {
+            vic_frame_release(&request->frame);
+        }
+        cc_cleanup(&link->requests);
+
+        pthread_mutex_destroy(&link->call_lock);
+        pthread_cond_destroy(&link->call_cond);
+
+        cc_for_each(&link->mux_inbox, frame)
+        {
+            zframe_destroy(frame);
+        }
+        cc_cleanup(&link->mux_inbox);
+
+        cc_for_each(&link->spill, message)
+        {
+            ring_message_release(*message);
+        }
+        cc_cleanup(&link->spill);
+
+        cc_for_each(&link->plain, message)
+        {
+            ring_message_release(*message);
+        }
+        cc_cleanup(&link->plain);
+
+        if (link->mux != NULL && atomic_fetch_sub(&link->mux->references, 1) == 1)
+        {
+            if (link->mux->sock)
+                zsock_destroy(&link->mux->sock);
+
+            free(link->mux->name);
+            free(link->mux->addr);
+            cc_cleanup(&link->mux->channels);
+            pthread_mutex_destroy(&link->mux->lock);
+            free(link->mux);
+        }
+
+        cc_for_each(&link->topics, topic)
+        {
+            free(*topic);
+        }
+        cc_cleanup(&link->topics);
+
+        if (link->broadcast != NULL)
+        {
+            _vic_broadcast_leave(link->broadcast, link);
+        }
+
+        if (atomic_fetch_sub(&link->ring_channel->references, 1) == 1)
+        {
+            ring_buffer_destroy(&link->ring_channel->rings[0]);
+            ring_buffer_destroy(&link->ring_channel->rings[1]);
+            free(link->ring_channel);
+        }
+
+        if (link->shm_channel != NULL && atomic_fetch_sub(&link->shm_channel->references, 1) == 1)
+        {
+            shm_ring_pair_destroy(link->shm_channel->mapping, SHM_RING_CAPACITY);
+            free(link->shm_channel);
+        }
     }
 }
 
@@ -686,10 +1247,20 @@ void vic_ef_destroy(vic_ef_t *ef)
         ef->finished(vic);
     }
 
+    // Everything allocated for the execution flow goes with it
+    _destroy_region(ef->region);
+
     ef->vic->ef = NULL;
     free(ef);
 }
 
+void vic_ef_heap_reset(vic_ef_t *ef)
+{
+    _ef_enter(ef);
+    _reset_region(ef->region);
+    _ef_leave(ef);
+}
+
 struct _vic_with_thread_info_t* _find_vic_with_thread_info(vic_t *vic)
 {
     struct _vic_with_thread_info_t *result = NULL;
@@ -737,28 +1308,148 @@ void *_vic_thread_start_helper(void *data)
     return NULL;
 }
 
-void _vic_start_helper(vic_t *vic)
+void _vic_link_apply_hwm(_vic_link_t *link)
 {
-    cc_for_each(&vic->links, link)
+    if (link->send_hwm > 0)
+    {
+        zsock_set_sndhwm(link->zmq_sock, link->send_hwm);
+    }
+
+    if (link->recv_hwm > 0)
     {
-        link->zmq_sock = zsock_new(link->zmq_type);
-        zsock_set_sndtimeo(link->zmq_sock, WAIT_TIMEOUT * 1000);
-        zsock_set_rcvtimeo(link->zmq_sock, WAIT_TIMEOUT * 1000);
+        zsock_set_rcvhwm(link->zmq_sock, link->recv_hwm);
+    }
+}
+
+void _vic_mux_connect(_vic_mux_t *mux)
+{
+    mux->sock = zsock_new(mux->zmq_type);
+    zsock_set_sndtimeo(mux->sock, WAIT_TIMEOUT * 1000);
+    zsock_set_rcvtimeo(mux->sock, WAIT_TIMEOUT * 1000);
 
-        // Disable false positive warning
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-security"
 
-        if (link->zmq_bind)
-        {
-            zsock_bind(link->zmq_sock, link->zmq_addr);
-        }
-        else
-        {
-            zsock_connect(link->zmq_sock, link->zmq_addr);
+    if (mux->bind)
+    {
+        zsock_bind(mux->sock, mux->addr);
+    }
+    else
+    {
+        zsock_connect(mux->sock, mux->addr);
+    }
+
+#pragma GCC diagnostic pop
+}
+
+// Creates the socket of a link that uses zmq and does not have one yet, must be called with the lock of the link
+void _vic_link_establish(_vic_link_t *link)
+{
+    if (link->ring || link->shm)
+    {
+        return;
+    }
+
+    if (link->mux != NULL)
+    {
+        pthread_mutex_lock(&link->mux->lock);
+        if (link->mux->sock == NULL)
+        {
+            _vic_mux_connect(link->mux);
         }
+        pthread_mutex_unlock(&link->mux->lock);
+        return;
+    }
+
+    if (link->zmq_sock != NULL)
+    {
+        return;
+    }
+
+    link->zmq_sock = zsock_new(link->zmq_type);
+    zsock_set_sndtimeo(link->zmq_sock, WAIT_TIMEOUT * 1000);
+    zsock_set_rcvtimeo(link->zmq_sock, WAIT_TIMEOUT * 1000);
+
+    // The high-water marks only apply to the connections made afterwards
+    _vic_link_apply_hwm(link);
+
+    // Disable false positive warning
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+
+    if (link->zmq_bind)
+    {
+        zsock_bind(link->zmq_sock, link->zmq_addr);
+    }
+    else
+    {
+        zsock_connect(link->zmq_sock, link->zmq_addr);
+    }
 
 #pragma GCC diagnostic pop
+
+    // The sockets are created again after every transformation, so the subscriptions are replayed
+    cc_for_each(&link->topics, topic)
+    {
+        zsock_set_subscribe(link->zmq_sock, *topic);
+    }
+}
+
+// Establishes the sockets of the vic one link at a time, each link is locked like for a send,
+// so the first user of a link never waits for the others
+void *_vic_socket_thread(void *data)
+{
+    vic_t *vic = (vic_t *)data;
+
+    cc_for_each(&vic->links, link)
+    {
+        if (atomic_load(&vic->socket_thread_stop))
+        {
+            break;
+        }
+
+        _vic_link_lock(vic->ef, link);
+        _vic_link_establish(link);
+        _vic_link_unlock(vic->ef, link);
+    }
+
+    return NULL;
+}
+
+// Must be called before the execution flow of the vic is quiesced, the thread may be waiting to enter it
+void _vic_socket_thread_stop(vic_t *vic)
+{
+    if (vic->socket_thread_running)
+    {
+        atomic_store(&vic->socket_thread_stop, 1);
+        pthread_join(vic->socket_thread, NULL);
+        vic->socket_thread_running = false;
+    }
+}
+
+// The links are established on first use in any mode, the flags only decide what is done up front
+void _vic_start_helper(vic_t *vic)
+{
+    if (vic->socket_flags & VIC_SOCKETS_BACKGROUND && vic->ef != NULL)
+    {
+        _vic_socket_thread_stop(vic);
+
+        atomic_store(&vic->socket_thread_stop, 0);
+        vic->socket_thread_running = pthread_create(&vic->socket_thread, NULL, _vic_socket_thread, vic) == 0;
+        if (vic->socket_thread_running)
+        {
+            return;
+        }
+    }
+
+    if (vic->socket_flags & VIC_SOCKETS_LAZY)
+    {
+        return;
+    }
+
+    cc_for_each(&vic->links, link)
+    {
+        _vic_link_establish(link);
     }
 }
 
@@ -807,6 +1498,11 @@ vic_ef_t *vic_ef_get(vic_t *vic)
     return vic->ef;
 }
 
+void vic_set_socket_flags(vic_t *vic, int flags)
+{
+    vic->socket_flags = flags;
+}
+
 // Starting function for an execution flow that is a process
 void _vic_start_process(vic_t *vic)
 {
@@ -820,6 +1516,9 @@ void _vic_start_process(vic_t *vic)
     {
         zsys_shutdown();
 
+        // The parent keeps the heap as it is at the fork, the transformation only needs what the child changes
+        clear_dynamic_data_changes();
+
         struct _vic_with_thread_info_t *current_vic_ptr = _find_vic_with_thread_info(vic);
         current_vic_ptr->tid = syscall(__NR_gettid);
         current_vic_ptr->thread = pthread_self();
@@ -906,11 +1605,13 @@ enum _wait_result_t _vic_wait_process(vic_t *vic)
 typedef struct {
     int zmq_type;
     char* transport_prefix;
+    int ring; // 1 if the messages go through the lock-free rings instead of the socket
+    int shm;  // 1 if the messages go through the shared memory rings when both ends can map them
 } transport_params_t;
 
 transport_params_t _transport_params[] = {
-    {ZMQ_DEALER, "ipc:///tmp/"},
-    {ZMQ_PAIR, "inproc://"}
+    {ZMQ_DEALER, "ipc:///tmp/", 0, 1},
+    {ZMQ_PAIR, "inproc://", 1, 0}
 };
 
 transport_params_t* _get_transport_params(vic_t* vic1, vic_t* vic2) {
@@ -928,26 +1629,49 @@ void _vic_reinit_links(vic_t *vic)
 {
     cc_for_each(&vic->links, link)
     {
-        char* name = strdup(link->zmq_addr + strlen(link->zmq_transport_prefix));
-
         transport_params_t* transport_params = _get_transport_params(vic, vic);
 
         link->zmq_type = transport_params->zmq_type;
+        if (link->role != LINK_PAIR)
+        {
+            link->zmq_type = link->role == LINK_PUBLISHER ? ZMQ_PUB : ZMQ_SUB;
+        }
+
+        // Messages left in the rings after a merge of processes may point to the heap of a process
+        // that does not exist anymore, so the rings are restarted: each process moved its own copy to the spill buffers.
+        // In the opposite direction the rings are kept, each process drains its own copy of the receiving ring.
+        if (transport_params->ring && !link->ring)
+        {
+            ring_buffer_reset(link->ring_tx);
+            ring_buffer_reset(link->ring_rx);
+        }
+        link->ring = transport_params->ring;
+
+        // The processes made by a transformation are not forked from the process that mapped the memfd,
+        // so the shared memory rings are only drained from now on
+        link->shm = 0;
 
         free(link->zmq_transport_prefix);
         link->zmq_transport_prefix = strdup(transport_params->transport_prefix);
 
         free(link->zmq_addr);
         
-        int total_len = strlen(link->zmq_transport_prefix) + strlen(name) + 1;
+        int total_len = strlen(link->zmq_transport_prefix) + strlen(link->name) + 1;
         char *addr = (char *)calloc(total_len, sizeof(char));
 
         strcpy(addr, link->zmq_transport_prefix);
-        strcat(addr, name);
+        strcat(addr, link->name);
 
         link->zmq_addr = addr;
 
-        free(name);
+        if (link->mux != NULL)
+        {
+            free(link->mux->addr);
+            link->mux->addr = calloc(strlen(link->zmq_transport_prefix) + strlen(link->mux->name) + 1, sizeof(char));
+            strcpy(link->mux->addr, link->zmq_transport_prefix);
+            strcat(link->mux->addr, link->mux->name);
+            link->mux->zmq_type = link->zmq_type;
+        }
     }
 }
 
@@ -1024,27 +1748,87 @@ vic_ef_t *vic_ef_create(vic_t *vic, void (*start_routine)(vic_t *), void (*finis
     vic->ef = ef;
     ef->vic = vic;
 
-    pthread_mutexattr_t attr;
+    atomic_init(&ef->active, 0);
+    atomic_init(&ef->quiescing, 0);
 
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&ef->lock, &attr);
-
-    pthread_mutexattr_destroy(&attr);
+    ef->region = _create_region();
 
     return ef;
 }
 
 void _vic_link_init_helper(_vic_link_t *link)
 {
+    link->name = NULL;
     link->zmq_type = 0;
     link->zmq_transport_prefix = NULL;
     link->zmq_addr = NULL;
     link->zmq_sock = NULL;
     link->zmq_bind = 0;
+    link->ring_channel = NULL;
+    link->ring_tx = NULL;
+    link->ring_rx = NULL;
+    link->ring = 0;
+    link->shm_channel = NULL;
+    link->shm_tx = NULL;
+    link->shm_rx = NULL;
+    link->shm = 0;
+    link->send_hwm = 0;
+    link->recv_hwm = 0;
+    link->policy = VIC_LINK_BLOCK;
+    link->role = LINK_PAIR;
+    link->broadcast = NULL;
+    cc_init(&link->topics);
+    link->call_receiving = false;
+    link->call_id = 0;
+    cc_init(&link->replies);
+    cc_init(&link->requests);
+    link->mux = NULL;
+    link->channel = 0;
+    cc_init(&link->mux_inbox);
+    cc_init(&link->spill);
+    cc_init(&link->plain);
+}
+
+// The synchronisation objects are initialised in place, the list nodes never move
+void _vic_link_init_locks(_vic_link_t *link)
+{
+    pthread_mutex_init(&link->lock, NULL);
+    pthread_mutex_init(&link->call_lock, NULL);
+    pthread_cond_init(&link->call_cond, NULL);
+}
+
+_vic_mux_t *_vic_find_mux(vic_t *vic, vic_t *peer)
+{
+    cc_for_each(&vic->links, link)
+    {
+        if (link->mux != NULL && link->mux->peer == peer)
+        {
+            return link->mux;
+        }
+    }
+
+    return NULL;
+}
+
+_vic_mux_t *_vic_mux_new(vic_t *peer, const char *name, int zmq_type, const char *transport_prefix, int bind)
+{
+    _vic_mux_t *mux = malloc(sizeof(_vic_mux_t));
+    pthread_mutex_init(&mux->lock, NULL);
+    mux->peer = peer;
+    mux->name = strdup(name);
+    mux->addr = calloc(strlen(transport_prefix) + strlen(name) + 1, sizeof(char));
+    strcpy(mux->addr, transport_prefix);
+    strcat(mux->addr, name);
+    mux->zmq_type = zmq_type;
+    mux->bind = bind;
+    mux->sock = NULL;
+    mux->next_channel = 0;
+    cc_init(&mux->channels);
+    atomic_init(&mux->references, 0);
+    return mux;
 }
 
-void _vic_link_helper(vic_t *vic1, vic_t *vic2, const char *name, int zmq_type, const char *transport_prefix)
+void _vic_link_helper(vic_t *vic1, vic_t *vic2, const char *name, int zmq_type, const char *transport_prefix, int ring, int shm)
 {
     _vic_link_t vic1_link;
     _vic_link_init_helper(&vic1_link);
@@ -1054,6 +1838,9 @@ void _vic_link_helper(vic_t *vic1, vic_t *vic2, const char *name, int zmq_type,
     vic1_link.zmq_bind = 0;
     vic2_link.zmq_bind = 1;
 
+    vic1_link.name = strdup(name);
+    vic2_link.name = strdup(name);
+
     vic1_link.zmq_type = zmq_type;
     vic1_link.zmq_transport_prefix = strdup(transport_prefix);
 
@@ -1069,14 +1856,179 @@ void _vic_link_helper(vic_t *vic1, vic_t *vic2, const char *name, int zmq_type,
     vic1_link.zmq_addr = addr;
     vic2_link.zmq_addr = strdup(addr);
 
-    cc_push(&vic1->links, vic1_link);
-    cc_push(&vic2->links, vic2_link);
+    // The rings are created for every link, so the link can switch to them after a transformation
+    _vic_ring_channel_t *ring_channel = aligned_alloc(RING_BUFFER_CACHE_LINE, sizeof(_vic_ring_channel_t));
+    ring_buffer_init(&ring_channel->rings[0], false);
+    ring_buffer_init(&ring_channel->rings[1], false);
+    atomic_init(&ring_channel->references, 2);
+
+    vic1_link.ring_channel = ring_channel;
+    vic1_link.ring_tx = &ring_channel->rings[0];
+    vic1_link.ring_rx = &ring_channel->rings[1];
+    vic1_link.ring = ring;
+
+    vic2_link.ring_channel = ring_channel;
+    vic2_link.ring_tx = &ring_channel->rings[1];
+    vic2_link.ring_rx = &ring_channel->rings[0];
+    vic2_link.ring = ring;
+
+    // The memfd is mapped before the vics are forked in _vic_start_process, so the children inherit it
+    if (shm)
+    {
+        char memfd_name[ADDR_BUFFER_LEN] = {};
+        snprintf(memfd_name, ADDR_BUFFER_LEN, "vic-%s", name);
+
+        _vic_shm_channel_t *shm_channel = malloc(sizeof(_vic_shm_channel_t));
+        shm_channel->mapping = shm_ring_pair_new(memfd_name, SHM_RING_CAPACITY, &vic1_link.shm_tx, &vic2_link.shm_tx);
+
+        if (shm_channel->mapping != NULL)
+        {
+            atomic_init(&shm_channel->references, 2);
+
+            vic1_link.shm_channel = shm_channel;
+            vic1_link.shm_rx = vic2_link.shm_tx;
+            vic1_link.shm = 1;
+
+            vic2_link.shm_channel = shm_channel;
+            vic2_link.shm_rx = vic1_link.shm_tx;
+            vic2_link.shm = 1;
+        }
+        else
+        {
+            free(shm_channel);
+            vic1_link.shm_tx = NULL;
+            vic2_link.shm_tx = NULL;
+        }
+    }
+
+    _vic_mux_t *mux1 = NULL;
+    _vic_mux_t *mux2 = NULL;
+    if ((vic1->socket_flags | vic2->socket_flags) & VIC_SOCKETS_MULTIPLEXED)
+    {
+        mux1 = _vic_find_mux(vic1, vic2);
+        mux2 = _vic_find_mux(vic2, vic1);
+
+        if (mux1 == NULL || mux2 == NULL)
+        {
+            // The first link between the vics names the socket, vic2 binds it like the links do
+            char mux_name[ADDR_BUFFER_LEN] = {};
+            snprintf(mux_name, ADDR_BUFFER_LEN, "vic-mux-%s", name);
+
+            mux1 = _vic_mux_new(vic2, mux_name, zmq_type, transport_prefix, 0);
+            mux2 = _vic_mux_new(vic1, mux_name, zmq_type, transport_prefix, 1);
+        }
+
+        vic1_link.mux = mux1;
+        vic1_link.channel = mux1->next_channel++;
+        atomic_fetch_add(&mux1->references, 1);
+
+        vic2_link.mux = mux2;
+        vic2_link.channel = mux2->next_channel++;
+        atomic_fetch_add(&mux2->references, 1);
+    }
+
+    _vic_link_t *link1 = cc_push(&vic1->links, vic1_link);
+    _vic_link_t *link2 = cc_push(&vic2->links, vic2_link);
+
+    _vic_link_init_locks(link1);
+    _vic_link_init_locks(link2);
+
+    if (mux1 != NULL)
+    {
+        cc_insert(&mux1->channels, link1->channel, link1);
+        cc_insert(&mux2->channels, link2->channel, link2);
+    }
+}
+
+// Checks that the vic will see a mapping created now: it runs in the current process or is forked from it later
+bool _vic_can_share_memory(vic_t *vic)
+{
+    if (vic == main_vic)
+    {
+        return getpid() == main_pid;
+    }
+
+    struct _vic_with_thread_info_t *vic_ptr = _find_vic_with_thread_info(vic);
+    if (vic_ptr == NULL || !vic_ptr->executing)
+    {
+        return true;
+    }
+
+    if (vic->abstraction & EF_PROCESS)
+    {
+        return vic_ptr->tid == (unsigned int)getpid();
+    }
+
+    return getpid() == main_pid;
 }
 
 void vic_link(vic_t *vic1, vic_t *vic2, const char *name)
 {
     transport_params_t* transport_params = _get_transport_params(vic1, vic2);
-    _vic_link_helper(vic1, vic2, name, transport_params->zmq_type, transport_params->transport_prefix);
+    int shm = transport_params->shm && _vic_can_share_memory(vic1) && _vic_can_share_memory(vic2);
+    _vic_link_helper(vic1, vic2, name, transport_params->zmq_type, transport_params->transport_prefix, transport_params->ring, shm);
+}
+
+// Creates one end of a broadcast link. Every end has its own rings: the publisher pushes the shared
+// message to the receiving ring of each subscriber, its own rings stay empty.
+_vic_link_t *_vic_broadcast_end_helper(vic_t *vic, const char *name, enum _vic_link_role_t role, transport_params_t *transport_params, _vic_broadcast_t *broadcast)
+{
+    _vic_link_t link;
+    _vic_link_init_helper(&link);
+
+    link.name = strdup(name);
+    link.role = role;
+    link.broadcast = broadcast;
+
+    link.zmq_type = role == LINK_PUBLISHER ? ZMQ_PUB : ZMQ_SUB;
+    link.zmq_bind = role == LINK_PUBLISHER;
+    link.zmq_transport_prefix = strdup(transport_params->transport_prefix);
+
+    int total_len = strlen(transport_params->transport_prefix) + strlen(name) + 1;
+    link.zmq_addr = (char *)calloc(total_len, sizeof(char));
+    strcpy(link.zmq_addr, transport_params->transport_prefix);
+    strcat(link.zmq_addr, name);
+
+    _vic_ring_channel_t *ring_channel = aligned_alloc(RING_BUFFER_CACHE_LINE, sizeof(_vic_ring_channel_t));
+    ring_buffer_init(&ring_channel->rings[0], false);
+    ring_buffer_init(&ring_channel->rings[1], false);
+    atomic_init(&ring_channel->references, 1);
+
+    link.ring_channel = ring_channel;
+    link.ring_tx = &ring_channel->rings[0];
+    link.ring_rx = &ring_channel->rings[1];
+    link.ring = transport_params->ring;
+
+    _vic_link_t *result = cc_push(&vic->links, link);
+    _vic_link_init_locks(result);
+
+    return result;
+}
+
+void vic_broadcast(vic_t *publisher, vic_t *subscribers[], int count, const char *name)
+{
+    // The rings are only shared when all the ends are threads, a single process end makes everyone use PUB/SUB
+    transport_params_t *transport_params = _get_transport_params(publisher, publisher);
+    for (int i = 0; i < count; i++)
+    {
+        if (subscribers[i]->abstraction & EF_PROCESS)
+        {
+            transport_params = _get_transport_params(subscribers[i], subscribers[i]);
+        }
+    }
+
+    _vic_broadcast_t *broadcast = malloc(sizeof(_vic_broadcast_t));
+    pthread_mutex_init(&broadcast->lock, NULL);
+    cc_init(&broadcast->subscribers);
+    atomic_init(&broadcast->references, count + 1);
+
+    _vic_broadcast_end_helper(publisher, name, LINK_PUBLISHER, transport_params, broadcast);
+
+    for (int i = 0; i < count; i++)
+    {
+        _vic_link_t *subscriber = _vic_broadcast_end_helper(subscribers[i], name, LINK_SUBSCRIBER, transport_params, broadcast);
+        cc_push(&broadcast->subscribers, subscriber);
+    }
 }
 
 void vic_ef_start(vic_ef_t *ef)
@@ -1113,76 +2065,1750 @@ void vic_ef_wait(vic_ef_t *ef)
         while (wait_result == NOT_DONE)
         {
             sleep(1);
-            pthread_mutex_lock(&main_vic->ef->lock);
+            _ef_enter(main_vic->ef);
             wait_result = vic->wait(vic);
-            pthread_mutex_unlock(&main_vic->ef->lock);
+            _ef_leave(main_vic->ef);
         }
     }
 }
 
-int vic_ef_send(vic_ef_t *ef, const char *name, const char data[])
+_vic_link_t *_vic_find_link(vic_t *vic, const char *name)
 {
-    cc_for_each(&ef->vic->links, link)
+    cc_for_each(&vic->links, link)
     {
-        char addr[ADDR_BUFFER_LEN] = {};
-        strcpy(addr, link->zmq_transport_prefix);
-        strcat(addr, name);
-
-        if (strcmp(link->zmq_addr, addr) == 0)
+        if (strcmp(link->name, name) == 0)
         {
-            int result = -1;
-            while (result != 0)
-            {
-                pthread_mutex_lock(&ef->lock);
-                result = zstr_send(link->zmq_sock, data);
-                pthread_mutex_unlock(&ef->lock);
-            }
-            return 1;
+            return link;
         }
     }
 
-    return 0;
+    return NULL;
 }
 
-data_ptr(char) vic_ef_recv(vic_ef_t *ef, const char *name)
+// The links are stored in a list, so the address of a link is stable for the whole life of the vic.
+// Transformations only change the transport of the link in place, which keeps the handle valid.
+vic_link_handle_t vic_ef_link(vic_ef_t *ef, const char *name)
+{
+    return _vic_find_link(ef->vic, name);
+}
+
+enum _send_result_t
+{
+    SEND_DONE = 0,     // The message is queued
+    SEND_FULL = 1,     // The queue is full and the policy of the link does not allow to wait
+    SEND_FALLBACK = 2  // The message has to be sent through the zmq socket
+};
+
+// Maximum number of messages queued in a local transport, the high-water mark of the link if it is set
+size_t _vic_local_window(_vic_link_t *link, size_t capacity)
 {
-    cc_for_each(&ef->vic->links, link)
+    if (link->send_hwm > 0 && (size_t)link->send_hwm < capacity)
     {
-        char addr[ADDR_BUFFER_LEN] = {};
-        strcpy(addr, link->zmq_transport_prefix);
-        strcat(addr, name);
+        return link->send_hwm;
+    }
+
+    return capacity;
+}
+
+// Pushes a message to the ring of the link, waiting while the ring is full if the policy allows it.
+// The lock is only held for the push itself: an uncontended mutex stays in user space
+// and it keeps the transformation from splitting the vics in the middle of a push.
+// The message belongs to the ring once SEND_DONE is returned, the caller keeps it otherwise.
+enum _send_result_t _vic_ring_send(vic_ef_t *ef, _vic_link_t *link, ring_message_t *message)
+{
+    size_t window = _vic_local_window(link, RING_BUFFER_CAPACITY);
+
+    unsigned int spins = 0;
+    for (;;)
+    {
+        _vic_link_lock(ef, link);
+        bool ring = link->ring;
+        bool pushed = false;
 
-        if (strcmp(link->zmq_addr, addr) == 0)
+        if (ring && link->policy == VIC_LINK_DROP_OLDEST && ring_buffer_size(link->ring_tx) >= window)
         {
-            data_ptr(char) result;
+            ring_message_release(ring_buffer_pop(link->ring_tx));
+        }
 
-            char *message = NULL;
-            while (message == NULL)
-            {
-                pthread_mutex_lock(&ef->lock);
+        if (ring && ring_buffer_size(link->ring_tx) < window)
+        {
+            pushed = ring_buffer_push(link->ring_tx, message);
+        }
+        _vic_link_unlock(ef, link);
+
+        if (pushed)
+        {
+            return SEND_DONE;
+        }
+
+        if (!ring)
+        {
+            return SEND_FALLBACK;
+        }
+
+        if (link->policy == VIC_LINK_NONBLOCK)
+        {
+            return SEND_FULL;
+        }
+
+        ring_buffer_backoff(&spins);
+    }
+}
+
+// Writes a message made of parts to the shared memory ring of the link, they are copied straight into the records.
+// Messages bigger than a fragment are split, the first fragment tells the size of the whole message.
+// The consumer may be using the oldest records in place, so VIC_LINK_DROP_OLDEST drops the new message instead.
+// The link may switch to another transport in the middle of a message: the receiver drops
+// the fragments written so far and the whole message is sent again through the new transport.
+// The flags, SHM_RECORD_CALL or 0, are set on every fragment.
+enum _send_result_t _vic_shm_sendv(vic_ef_t *ef, _vic_link_t *link, const struct iovec *parts, int count, uint64_t flags)
+{
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size += parts[i].iov_len;
+    }
+
+    size_t max_fragment = shm_ring_max_fragment(link->shm_tx);
+    size_t window = _vic_local_window(link, SHM_RING_DEFAULT_HWM);
+    size_t sent = 0;
+
+    unsigned int spins = 0;
+    do
+    {
+        size_t fragment = size - sent < max_fragment ? size - sent : max_fragment;
+        bool more = sent + fragment < size;
 
-                message = zstr_recv(link->zmq_sock);
+        _vic_link_lock(ef, link);
+        bool shm = link->shm;
+        unsigned int seen = shm_ring_space_sequence(link->shm_tx);
+        unsigned char *payload = NULL;
 
-                size_t message_len = strlen(message) + 1;
-                result = allocate_array(char, message_len, ef);
+        // The window only holds back new messages, the fragments of a started message always follow
+        if (shm && (sent > 0 || shm_ring_size(link->shm_tx) < window))
+        {
+            payload = shm_ring_try_reserve(link->shm_tx, fragment, more);
+        }
 
-                write_all_values_to_array(result, message, message_len);
+        if (payload != NULL)
+        {
+            uint64_t record_flags = flags;
+            if (sent == 0 && more)
+            {
+                record_flags |= (uint64_t)size << SHM_RECORD_MESSAGE_SHIFT;
+            }
+            ((shm_record_t *)payload - 1)->flags |= record_flags;
 
-                pthread_mutex_unlock(&ef->lock);
+            // Copy the bytes [sent, sent + fragment) of the parts
+            size_t offset = 0;
+            size_t copied = 0;
+            for (int i = 0; i < count && copied < fragment; i++)
+            {
+                size_t length = parts[i].iov_len;
+                if (sent + copied < offset + length)
+                {
+                    size_t start = sent + copied - offset;
+                    size_t chunk = length - start < fragment - copied ? length - start : fragment - copied;
+                    memcpy(payload + copied, (const unsigned char *)parts[i].iov_base + start, chunk);
+                    copied += chunk;
+                }
+                offset += length;
             }
-            return result;
+
+            shm_ring_commit(link->shm_tx, payload);
+        }
+        _vic_link_unlock(ef, link);
+
+        if (payload != NULL)
+        {
+            sent += fragment;
+            spins = 0;
+            continue;
+        }
+
+        if (!shm)
+        {
+            return SEND_FALLBACK;
+        }
+
+        if (sent == 0 && link->policy != VIC_LINK_BLOCK)
+        {
+            return SEND_FULL;
+        }
+
+        shm_ring_wait_space(link->shm_tx, seen, &spins, LOCAL_WAIT_TIMEOUT_MS);
+    } while (sent < size);
+
+    return SEND_DONE;
+}
+
+enum _send_result_t _vic_shm_send(vic_ef_t *ef, _vic_link_t *link, const void *data, size_t size)
+{
+    struct iovec part = {(void *)data, size};
+    return _vic_shm_sendv(ef, link, &part, 1, 0);
+}
+
+// Sends the message through the rings or the shared memory of the link
+enum _send_result_t _vic_send_local(vic_ef_t *ef, _vic_link_t *link, const void *data, size_t size)
+{
+    enum _send_result_t result = SEND_FALLBACK;
+
+    if (link->ring)
+    {
+        ring_message_t *message = ring_message_new(data, size);
+        result = _vic_ring_send(ef, link, message);
+        if (result != SEND_DONE)
+        {
+            free(message);
         }
     }
 
-    return NULLPTR(char);
+    if (result == SEND_FALLBACK && link->shm)
+    {
+        result = _vic_shm_send(ef, link, data, size);
+    }
+
+    return result;
+}
+
+// Socket of the link, established on first use. The shared socket is locked as well, must be called with the lock of the link
+zsock_t *_vic_link_socket_lock(_vic_link_t *link)
+{
+    _vic_link_establish(link);
+
+    if (link->mux == NULL)
+    {
+        return link->zmq_sock;
+    }
+
+    pthread_mutex_lock(&link->mux->lock);
+    return link->mux->sock;
+}
+
+void _vic_link_socket_unlock(_vic_link_t *link)
+{
+    if (link->mux != NULL)
+    {
+        pthread_mutex_unlock(&link->mux->lock);
+    }
+}
+
+// Sends the channel id, the header of a call if any and the payload as one message,
+// zmq accepts all the parts once the first one is queued
+int _vic_mux_send(zsock_t *sock, uint32_t channel, zframe_t **header, zframe_t **frame)
+{
+    zframe_t *channel_frame = zframe_new(&channel, sizeof(channel));
+    if (zframe_send(&channel_frame, sock, ZFRAME_MORE | ZFRAME_DONTWAIT) != 0)
+    {
+        zframe_destroy(&channel_frame);
+        return -1;
+    }
+
+    if (header != NULL)
+    {
+        zframe_send(header, sock, ZFRAME_MORE);
+    }
+
+    return zframe_send(frame, sock, 0);
+}
+
+// Moves the messages waiting on the shared socket to the inboxes of their links, must be called with the socket locked
+void _vic_mux_drain(_vic_mux_t *mux)
+{
+    while (mux->sock != NULL && zsock_events(mux->sock) & ZMQ_POLLIN)
+    {
+        zframe_t *channel_frame = zframe_recv(mux->sock);
+        if (channel_frame == NULL)
+        {
+            return;
+        }
+
+        zframe_t *frame = zframe_more(channel_frame) ? zframe_recv(mux->sock) : NULL;
+        // The header of a call, its payload follows
+        zframe_t *payload = frame != NULL && zframe_more(frame) ? zframe_recv(mux->sock) : NULL;
+
+        uint32_t channel = UINT32_MAX;
+        if (zframe_size(channel_frame) == sizeof(channel))
+        {
+            memcpy(&channel, zframe_data(channel_frame), sizeof(channel));
+        }
+        zframe_destroy(&channel_frame);
+
+        _vic_link_t **link = cc_get(&mux->channels, channel);
+        if (link != NULL && frame != NULL)
+        {
+            cc_push(&(*link)->mux_inbox, frame);
+            if (payload != NULL)
+            {
+                cc_push(&(*link)->mux_inbox, payload);
+            }
+        }
+        else
+        {
+            zframe_destroy(&frame);
+            zframe_destroy(&payload);
+        }
+    }
+}
+
+// Receives the next message of a link sharing a socket. The socket is only locked for short slices,
+// whoever holds it receives the messages of all the links so none of them waits for another.
+// The header of a call goes to *header. Returns NULL if the receive was interrupted.
+zframe_t *_vic_mux_recv(vic_ef_t *ef, _vic_link_t *link, zframe_t **header)
+{
+    for (;;)
+    {
+        if (_vic_recv_interrupted(ef, link))
+        {
+            return NULL;
+        }
+
+        _vic_link_lock(ef, link);
+        zsock_t *sock = _vic_link_socket_lock(link);
+
+        if (cc_size(&link->mux_inbox) == 0 && sock != NULL)
+        {
+            zmq_pollitem_t item = {zsock_resolve(sock), 0, ZMQ_POLLIN, 0};
+            zmq_poll(&item, 1, MUX_WAIT_SLICE_MS);
+            _vic_mux_drain(link->mux);
+        }
+
+        zframe_t *frame = NULL;
+        if (cc_size(&link->mux_inbox) > 0)
+        {
+            zframe_t **first = cc_first(&link->mux_inbox);
+            frame = *first;
+            cc_erase(&link->mux_inbox, first);
+        }
+
+        // The header and the payload of a call are queued together
+        if (frame != NULL && zframe_more(frame) && cc_size(&link->mux_inbox) > 0)
+        {
+            zframe_t **first = cc_first(&link->mux_inbox);
+            *header = frame;
+            frame = *first;
+            cc_erase(&link->mux_inbox, first);
+        }
+
+        _vic_link_socket_unlock(link);
+        _vic_link_unlock(ef, link);
+
+        if (frame != NULL)
+        {
+            return frame;
+        }
+
+        if (sock == NULL)
+        {
+            zclock_sleep(1);
+        }
+    }
+}
+
+// Sends a frame through the zmq socket of the link. The socket is only written to when it is ready,
+// so a blocking send sleeps in zmq_poll slices instead of retrying on the send timeout with the link locked.
+// zmq can not drop the queued messages, so VIC_LINK_DROP_OLDEST drops the new message instead.
+// A call is sent with its header, NULL for the plain messages, as a frame of its own before the payload.
+enum _send_result_t _vic_zmq_send(vic_ef_t *ef, _vic_link_t *link, zframe_t **header, zframe_t **frame)
+{
+    for (;;)
+    {
+        _vic_link_lock(ef, link);
+        zsock_t *sock = _vic_link_socket_lock(link);
+
+        int result = -1;
+        if (sock != NULL && link->mux != NULL)
+        {
+            result = _vic_mux_send(sock, link->channel, header, frame);
+        }
+        else if (sock != NULL && header != NULL)
+        {
+            result = zframe_send(header, sock, ZFRAME_MORE | ZFRAME_DONTWAIT);
+            if (result == 0)
+            {
+                result = zframe_send(frame, sock, 0);
+            }
+        }
+        else if (sock != NULL)
+        {
+            result = zframe_send(frame, sock, ZFRAME_DONTWAIT);
+        }
+
+        if (result != 0 && sock != NULL && link->policy == VIC_LINK_BLOCK)
+        {
+            zmq_pollitem_t item = {zsock_resolve(sock), 0, ZMQ_POLLOUT, 0};
+            zmq_poll(&item, 1, link->mux != NULL ? MUX_WAIT_SLICE_MS : LOCAL_WAIT_TIMEOUT_MS);
+        }
+
+        _vic_link_socket_unlock(link);
+        _vic_link_unlock(ef, link);
+
+        if (result != 0 && sock == NULL)
+        {
+            // The socket is not established yet
+            zclock_sleep(1);
+        }
+
+        if (result == 0)
+        {
+            return SEND_DONE;
+        }
+
+        if (link->policy != VIC_LINK_BLOCK)
+        {
+            if (header != NULL)
+            {
+                zframe_destroy(header);
+            }
+            zframe_destroy(frame);
+            return SEND_FULL;
+        }
+    }
+}
+
+// Sends a message built by the caller through the transport of the link, the message is always consumed
+enum _send_result_t _vic_send_message(vic_ef_t *ef, _vic_link_t *link, ring_message_t *message)
+{
+    enum _send_result_t result = SEND_FALLBACK;
+
+    if (link->ring)
+    {
+        result = _vic_ring_send(ef, link, message);
+        if (result == SEND_DONE)
+        {
+            return result;
+        }
+    }
+
+    bool call = message->flags & MESSAGE_CALL;
+
+    if (result == SEND_FALLBACK && link->shm)
+    {
+        struct iovec part = {message->data, message->size};
+        result = _vic_shm_sendv(ef, link, &part, 1, call ? SHM_RECORD_CALL : 0);
+    }
+
+    if (result == SEND_FALLBACK && call)
+    {
+        // The header of the call goes in a frame of its own
+        zframe_t *header = zframe_new(message->data, sizeof(_vic_call_header_t));
+        zframe_t *frame = zframe_new(message->data + sizeof(_vic_call_header_t), message->size - sizeof(_vic_call_header_t));
+        result = _vic_zmq_send(ef, link, &header, &frame);
+    }
+    else if (result == SEND_FALLBACK)
+    {
+        zframe_t *frame = zframe_new(message->data, message->size);
+        result = _vic_zmq_send(ef, link, NULL, &frame);
+    }
+
+    free(message);
+    return result;
+}
+
+void _vic_ring_message_release(void *owner, void *context)
+{
+    (void)context;
+    ring_message_release((ring_message_t *)owner);
+}
+
+void _vic_shm_record_release(void *owner, void *context)
+{
+    shm_ring_release((shm_ring_t *)context, (shm_record_t *)owner);
+}
+
+void _vic_zframe_release(void *owner, void *context)
+{
+    (void)context;
+    zframe_t *frame = (zframe_t *)owner;
+    zframe_destroy(&frame);
+}
+
+void _vic_frame_set(vic_frame_t *frame, const void *data, size_t size, void *owner, void *context, void (*release)(void *, void *))
+{
+    frame->data = data;
+    frame->size = size;
+    frame->_owner = owner;
+    frame->_context = context;
+    frame->_release = release;
+}
+
+// Collects the fragments of a message written by _vic_shm_send into a buffer of the size told by the first one.
+// Returns NULL if the sender switched to another transport before the last fragment.
+ring_message_t *_vic_shm_reassemble(vic_ef_t *ef, _vic_link_t *link, shm_record_t *record)
+{
+    size_t total = record->flags >> SHM_RECORD_MESSAGE_SHIFT;
+    size_t size = record->size < total ? record->size : total;
+    ring_message_t *message = ring_message_alloc(total);
+    memcpy(message->data, record + 1, size);
+    message->flags = record->flags & SHM_RECORD_CALL ? MESSAGE_CALL : 0;
+    bool more = record->flags & SHM_RECORD_MORE;
+
+    _vic_link_lock(ef, link);
+    shm_ring_release(link->shm_rx, record);
+    _vic_link_unlock(ef, link);
+
+    unsigned int spins = 0;
+    while (more)
+    {
+        _vic_link_lock(ef, link);
+        bool shm = link->shm;
+        unsigned int seen = shm_ring_data_sequence(link->shm_rx);
+        record = shm_ring_read(link->shm_rx);
+        if (record != NULL)
+        {
+            size_t fragment = record->size < total - size ? record->size : total - size;
+            memcpy(message->data + size, record + 1, fragment);
+            size += fragment;
+            more = record->flags & SHM_RECORD_MORE;
+            shm_ring_release(link->shm_rx, record);
+        }
+        _vic_link_unlock(ef, link);
+
+        if (record != NULL)
+        {
+            spins = 0;
+            continue;
+        }
+
+        if (!shm)
+        {
+            free(message);
+            return NULL;
+        }
+
+        shm_ring_wait_data(link->shm_rx, seen, &spins, LOCAL_WAIT_TIMEOUT_MS);
+    }
+
+    message->size = size;
+    return message;
+}
+
+// Call awaited by a thread while it receives on behalf of the call waiters of a link
+typedef struct
+{
+    _vic_link_t *link;                      // The link received from
+    bool (*ready)(_vic_link_t *, uint64_t); // Tells whether the awaited call is stored, with the call lock
+    uint64_t id;                            // Passed to ready
+} _vic_call_wait_t;
+
+// Set while a call waiter receives, it leaves the plain messages it kept to the other receives
+static _Thread_local _vic_call_wait_t *_vic_call_waiting = NULL;
+
+// Whether another receive of the link stored the call the thread waits for
+bool _vic_call_wait_over(_vic_link_t *link)
+{
+    _vic_call_wait_t *wait = _vic_call_waiting;
+    if (wait == NULL || wait->link != link)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&link->call_lock);
+    bool over = wait->ready(link, wait->id);
+    pthread_mutex_unlock(&link->call_lock);
+    return over;
+}
+
+// A blocking receive starts over once another receive of the link stored what it waits for:
+// the awaited call for a call waiter, a plain message for the others
+bool _vic_recv_interrupted(vic_ef_t *ef, _vic_link_t *link)
+{
+    if (_vic_call_waiting != NULL && _vic_call_waiting->link == link)
+    {
+        return _vic_call_wait_over(link);
+    }
+
+    _vic_link_lock(ef, link);
+    bool interrupted = cc_size(&link->plain) > 0;
+    _vic_link_unlock(ef, link);
+    return interrupted;
+}
+
+// Receives a message from the shared memory ring or the rings of the link, waiting while the link uses them.
+// Once the link switched to another transport, the messages left behind are drained first,
+// oldest transport first: shared memory is only used before the first transformation.
+// *call tells whether the message is a call, call may be NULL on the links without calls.
+// Returns 0 if the message has to be received from the zmq socket, -1 if the call wait of the thread is over.
+int _vic_recv_local(vic_ef_t *ef, _vic_link_t *link, vic_frame_t *frame, bool *call)
+{
+    bool waiting = _vic_call_waiting != NULL && _vic_call_waiting->link == link;
+
+    unsigned int spins = 0;
+    for (;;)
+    {
+        if (waiting && _vic_call_wait_over(link))
+        {
+            return -1;
+        }
+
+        _vic_link_lock(ef, link);
+        bool ring = link->ring;
+        bool shm = link->shm;
+
+        unsigned int seen = 0;
+        shm_record_t *record = NULL;
+        ring_message_t *message = NULL;
+
+        if (!waiting && cc_size(&link->plain) > 0)
+        {
+            ring_message_t **first = cc_first(&link->plain);
+            message = *first;
+            cc_erase(&link->plain, first);
+        }
+        else if (cc_size(&link->spill) > 0)
+        {
+            ring_message_t **first = cc_first(&link->spill);
+            message = *first;
+            cc_erase(&link->spill, first);
+        }
+        else if (link->shm_rx != NULL)
+        {
+            seen = shm_ring_data_sequence(link->shm_rx);
+            record = shm_ring_read(link->shm_rx);
+        }
+
+        if (record == NULL && message == NULL)
+        {
+            message = ring_buffer_pop(link->ring_rx);
+        }
+        _vic_link_unlock(ef, link);
+
+        if (record != NULL && !(record->flags & SHM_RECORD_MORE))
+        {
+            // The payload is used in place, the record is released with the frame
+            _vic_frame_set(frame, record + 1, record->size, record, link->shm_rx, _vic_shm_record_release);
+            if (call != NULL)
+            {
+                *call = record->flags & SHM_RECORD_CALL;
+            }
+            return 1;
+        }
+
+        if (record != NULL)
+        {
+            message = _vic_shm_reassemble(ef, link, record);
+            if (message == NULL)
+            {
+                continue;
+            }
+        }
+
+        if (message != NULL)
+        {
+            _vic_frame_set(frame, message->data, message->size, message, NULL, _vic_ring_message_release);
+            if (call != NULL)
+            {
+                *call = message->flags & MESSAGE_CALL;
+            }
+            return 1;
+        }
+
+        if (ring)
+        {
+            ring_buffer_backoff(&spins);
+        }
+        else if (shm)
+        {
+            shm_ring_wait_data(link->shm_rx, seen, &spins, LOCAL_WAIT_TIMEOUT_MS);
+        }
+        else
+        {
+            return 0;
+        }
+    }
+}
+
+// Receives the next message of the link from whichever transport it uses. The header of a call is moved
+// to *header, its kind is CALL_PLAIN for a plain message. Returns 0 if the call wait of the thread is over first.
+int _vic_recv_message(vic_ef_t *ef, _vic_link_t *link, vic_frame_t *frame, _vic_call_header_t *header)
+{
+    header->kind = CALL_PLAIN;
+
+    for (;;)
+    {
+        bool call = false;
+        int local = _vic_recv_local(ef, link, frame, &call);
+        if (local < 0)
+        {
+            return 0;
+        }
+
+        if (local > 0)
+        {
+            if (call && frame->size >= sizeof(*header))
+            {
+                memcpy(header, frame->data, sizeof(*header));
+                frame->data = (const unsigned char *)frame->data + sizeof(*header);
+                frame->size -= sizeof(*header);
+            }
+            return 1;
+        }
+
+        zframe_t *header_zmq = NULL;
+        zframe_t *zmq_frame = _vic_recv_frame_helper(ef, link, &header_zmq);
+        if (zmq_frame == NULL)
+        {
+            // Interrupted, what the receive waits for is served by the local path now
+            continue;
+        }
+
+        if (header_zmq != NULL && zframe_size(header_zmq) == sizeof(*header))
+        {
+            memcpy(header, zframe_data(header_zmq), sizeof(*header));
+        }
+        zframe_destroy(&header_zmq);
+
+        _vic_frame_set(frame, zframe_data(zmq_frame), zframe_size(zmq_frame), zmq_frame, NULL, _vic_zframe_release);
+        return 1;
+    }
+}
+
+// Keeps a received call for its waiter, must be called with the call lock
+void _vic_call_store(_vic_link_t *link, const _vic_call_header_t *header, vic_frame_t *frame)
+{
+    if (header->kind == CALL_REQUEST)
+    {
+        _vic_call_t call = {header->id, *frame};
+        cc_push(&link->requests, call);
+    }
+    else if (header->kind == CALL_REPLY)
+    {
+        cc_insert(&link->replies, header->id, *frame);
+    }
+    else
+    {
+        vic_frame_release(frame);
+    }
+}
+
+// Receives the next plain message of the link, the calls received before it are kept for their waiters
+void _vic_recv_plain(vic_ef_t *ef, _vic_link_t *link, vic_frame_t *frame)
+{
+    _vic_call_header_t header;
+    _vic_recv_message(ef, link, frame, &header);
+
+    while (header.kind != CALL_PLAIN)
+    {
+        pthread_mutex_lock(&link->call_lock);
+        _vic_call_store(link, &header, frame);
+        pthread_cond_broadcast(&link->call_cond);
+        pthread_mutex_unlock(&link->call_lock);
+
+        _vic_recv_message(ef, link, frame, &header);
+    }
+}
+
+int vic_ef_send_h(vic_ef_t *ef, vic_link_handle_t link, const char data[])
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return 0;
+    }
+
+    enum _send_result_t result = _vic_send_local(ef, link, data, strlen(data) + 1);
+    if (result == SEND_FALLBACK)
+    {
+        // Same frame as zstr_send: the string without its terminating NUL
+        zframe_t *frame = zframe_new(data, strlen(data));
+        result = _vic_zmq_send(ef, link, NULL, &frame);
+    }
+
+    return result == SEND_DONE ? 1 : -1;
+}
+
+data_ptr(char) vic_ef_recv_h(vic_ef_t *ef, vic_link_handle_t link)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return NULLPTR(char);
+    }
+
+    vic_frame_t frame;
+    _vic_recv_plain(ef, link, &frame);
+
+    // The rings carry the terminating NUL, the zmq frames do not, wherever they were kept:
+    // the string is the frame followed by a terminating NUL, the same as zstr_recv
+    bool terminated = frame.size > 0 && ((const char *)frame.data)[frame.size - 1] == '\0';
+    size_t length = terminated ? frame.size - 1 : frame.size;
+
+    // A null handle if the memory is exhausted, the message is dropped then
+    data_ptr(char) result = allocate_array(char, length + 1, ef);
+    if (!IS_NULLPTR(result))
+    {
+        write_values_to_array_range(result, (char *)frame.data, length + 1, 0, length);
+        write_value_to_array(result, length, '\0');
+    }
+
+    vic_frame_release(&frame);
+    return result;
+}
+
+int vic_ef_send(vic_ef_t *ef, const char *name, const char data[])
+{
+    return vic_ef_send_h(ef, _vic_find_link(ef->vic, name), data);
+}
+
+data_ptr(char) vic_ef_recv(vic_ef_t *ef, const char *name)
+{
+    return vic_ef_recv_h(ef, _vic_find_link(ef->vic, name));
+}
+
+// Waits at most a slice for a message on the socket, which is only read once it is ready
+bool _vic_socket_wait_in(zsock_t *sock)
+{
+    zmq_pollitem_t item = {zsock_resolve(sock), 0, ZMQ_POLLIN, 0};
+    return zmq_poll(&item, 1, MUX_WAIT_SLICE_MS) > 0;
+}
+
+// Receives the next frame of the link, the link is unlocked between the slices of the wait. The header of a call goes to *header.
+// Returns NULL if the receive was interrupted, see _vic_recv_interrupted.
+zframe_t *_vic_recv_frame_helper(vic_ef_t *ef, _vic_link_t *link, zframe_t **header)
+{
+    if (link->mux != NULL)
+    {
+        return _vic_mux_recv(ef, link, header);
+    }
+
+    zframe_t *frame = NULL;
+    while (frame == NULL)
+    {
+        if (_vic_recv_interrupted(ef, link))
+        {
+            return NULL;
+        }
+
+        _vic_link_lock(ef, link);
+        _vic_link_establish(link);
+        zsock_t *sock = link->zmq_sock;
+        if (sock != NULL && _vic_socket_wait_in(sock))
+        {
+            frame = zframe_recv(sock);
+        }
+
+        // The header of a call, the payload is part of the same message and already arrived
+        if (frame != NULL && zframe_more(frame))
+        {
+            *header = frame;
+            frame = zframe_recv(sock);
+            if (frame == NULL)
+            {
+                zframe_destroy(header);
+            }
+        }
+        _vic_link_unlock(ef, link);
+
+        if (sock == NULL)
+        {
+            // The link is switching to a local transport
+            zclock_sleep(1);
+        }
+    }
+    return frame;
+}
+
+int vic_ef_send_buf_h(vic_ef_t *ef, vic_link_handle_t link, const void *data, size_t size)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return 0;
+    }
+
+    enum _send_result_t result = _vic_send_local(ef, link, data, size);
+    if (result == SEND_FALLBACK)
+    {
+        // The payload is copied once into the zmq message, the caller keeps the ownership of data
+        zframe_t *frame = zframe_new(data, size);
+        result = _vic_zmq_send(ef, link, NULL, &frame);
+    }
+
+    return result == SEND_DONE ? 1 : -1;
+}
+
+ssize_t vic_ef_recv_buf_h(vic_ef_t *ef, vic_link_handle_t link, void *buffer, size_t capacity)
+{
+    vic_frame_t frame;
+    if (!vic_ef_recv_frame_h(ef, link, &frame))
+    {
+        return -1;
+    }
+
+    size_t size = frame.size;
+    memcpy(buffer, frame.data, size < capacity ? size : capacity);
+
+    vic_frame_release(&frame);
+    return (ssize_t)size;
+}
+
+int vic_ef_recv_frame_h(vic_ef_t *ef, vic_link_handle_t link, vic_frame_t *frame)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        _vic_frame_set(frame, NULL, 0, NULL, NULL, NULL);
+        return 0;
+    }
+
+    _vic_recv_plain(ef, link, frame);
+    return 1;
+}
+
+int vic_ef_send_buf(vic_ef_t *ef, const char *name, const void *data, size_t size)
+{
+    return vic_ef_send_buf_h(ef, _vic_find_link(ef->vic, name), data, size);
+}
+
+ssize_t vic_ef_recv_buf(vic_ef_t *ef, const char *name, void *buffer, size_t capacity)
+{
+    return vic_ef_recv_buf_h(ef, _vic_find_link(ef->vic, name), buffer, capacity);
+}
+
+int vic_ef_recv_frame(vic_ef_t *ef, const char *name, vic_frame_t *frame)
+{
+    return vic_ef_recv_frame_h(ef, _vic_find_link(ef->vic, name), frame);
+}
+
+enum _vic_ptr_kind_t
+{
+    PTR_HANDLE = 1, // The allocation stays in the shared heap, only its key is sent
+    PTR_BYTES = 2   // The content of the allocation follows the header
+};
+
+// Header of a message carrying an allocation
+typedef struct
+{
+    uint64_t kind;                // PTR_HANDLE or PTR_BYTES
+    data_pointer ptr;             // The allocation of the sender
+    unsigned long long type_size; // Size of the elements of the allocation
+    unsigned long long capacity;  // Number of elements of the allocation
+    uint64_t padding;             // Keeps the content 16 bytes aligned in the buffers of the rings
+} _vic_ptr_header_t;
+
+// The rings are only used between threads, which share the heap registry, so the key is enough there.
+// It is pushed under the lock of the link, which keeps a transformation from moving the receiver
+// to another process in between. Any other transport gets the content, read from the pinned allocation
+// straight into the shared memory records or the zmq frame.
+int _vic_ef_send_ptr(vic_ef_t *ef, vic_link_handle_t link, data_pointer ptr)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return 0;
+    }
+
+    _vic_ptr_header_t header = {PTR_HANDLE, ptr, 0, 0, 0};
+
+    _ef_enter(ef);
+    int found = _allocation_size(ptr, &header.type_size, &header.capacity);
+    _ef_leave(ef);
+
+    if (!found)
+    {
+        return 0;
+    }
+
+    // Every process sees the shared heap, the key is enough whatever the transport
+    if (_dynamic_memory_is_shared())
+    {
+        return _vic_send_message(ef, link, ring_message_new(&header, sizeof(header))) == SEND_DONE ? 1 : -1;
+    }
+
+    if (link->ring)
+    {
+        ring_message_t *message = ring_message_new(&header, sizeof(header));
+        enum _send_result_t result = _vic_ring_send(ef, link, message);
+        if (result != SEND_DONE)
+        {
+            free(message);
+        }
+
+        if (result != SEND_FALLBACK)
+        {
+            return result == SEND_DONE ? 1 : -1;
+        }
+    }
+
+    header.kind = PTR_BYTES;
+    size_t size = header.type_size * header.capacity;
+
+    _ef_enter(ef);
+    void *data = _pin(ptr);
+    _ef_leave(ef);
+
+    if (data == NULL)
+    {
+        return 0;
+    }
+
+    struct iovec parts[2] = {{&header, sizeof(header)}, {data, size}};
+    enum _send_result_t result = link->shm ? _vic_shm_sendv(ef, link, parts, 2, 0) : SEND_FALLBACK;
+
+    if (result == SEND_FALLBACK)
+    {
+        zframe_t *frame = zframe_new(NULL, sizeof(header) + size);
+        memcpy(zframe_data(frame), &header, sizeof(header));
+
+        _ef_enter(ef);
+        memcpy(zframe_data(frame) + sizeof(header), data, size);
+        _ef_leave(ef);
+
+        result = _vic_zmq_send(ef, link, NULL, &frame);
+    }
+
+    _ef_enter(ef);
+    _unpin(ptr);
+    // The receiver owns the copy now
+    if (result == SEND_DONE)
+    {
+        _deallocate(ptr);
+    }
+    _ef_leave(ef);
+
+    return result == SEND_DONE ? 1 : -1;
+}
+
+data_pointer _vic_ef_recv_ptr(vic_ef_t *ef, vic_link_handle_t link, size_t type_size)
+{
+    data_pointer result = {0, 0};
+
+    vic_frame_t frame;
+    if (link == NULL || !vic_ef_recv_frame_h(ef, link, &frame))
+    {
+        return result;
+    }
+
+    _vic_ptr_header_t header;
+    if (frame.size < sizeof(header))
+    {
+        vic_frame_release(&frame);
+        return result;
+    }
+    memcpy(&header, frame.data, sizeof(header));
+
+    _ef_enter(ef);
+
+    // The allocation joins the region of the receiver, so it outlives the execution flow of the sender
+    if (header.kind == PTR_HANDLE)
+    {
+        result = _move_allocation(header.ptr, ef->region);
+
+        // The allocation is not leaked when the receiver expects another type
+        if (result.tid != 0 && header.type_size != type_size)
+        {
+            _deallocate(result);
+            result.key = 0;
+            result.tid = 0;
+        }
+    }
+    else if (header.kind == PTR_BYTES && header.type_size == type_size && frame.size - sizeof(header) == header.type_size * header.capacity)
+    {
+        void *data = (char *)frame.data + sizeof(header);
+        if (frame._release == _vic_shm_record_release)
+        {
+            // The record goes back to the ring, the content is copied out of it once
+            result = _allocate_array_in(ef->region, header.capacity, header.type_size);
+            _write_values_to_array(result, data, header.capacity, 0, header.capacity);
+        }
+        else
+        {
+            // The received buffer becomes the data of the allocation, the frame is released with it
+            result = _adopt_array_in(ef->region, data, header.capacity, header.type_size, frame._owner, frame._context, frame._release);
+            _vic_frame_set(&frame, NULL, 0, NULL, NULL, NULL);
+        }
+    }
+
+    _ef_leave(ef);
+
+    vic_frame_release(&frame);
+    return result;
+}
+
+void vic_frame_release(vic_frame_t *frame)
+{
+    if (frame->_release != NULL)
+    {
+        frame->_release(frame->_owner, frame->_context);
+    }
+
+    _vic_frame_set(frame, NULL, 0, NULL, NULL, NULL);
+}
+
+void vic_link_configure(vic_ef_t *ef, vic_link_handle_t link, const vic_link_options_t *options)
+{
+    if (link == NULL)
+    {
+        return;
+    }
+
+    _vic_link_lock(ef, link);
+
+    link->send_hwm = options->send_hwm;
+    link->recv_hwm = options->recv_hwm;
+    link->policy = options->policy;
+
+    // Dropping the oldest message makes the sender a second consumer of the ring. The receivers see it on their next pop,
+    // a pop already started still takes the cell as the single consumer, hence the policy is set before the link is used.
+    atomic_store_explicit(&link->ring_tx->multi_consumer, options->policy == VIC_LINK_DROP_OLDEST, memory_order_release);
+
+    if (link->zmq_sock != NULL)
+    {
+        _vic_link_apply_hwm(link);
+    }
+
+    _vic_link_unlock(ef, link);
+}
+
+int vic_ef_send_credit(vic_ef_t *ef, vic_link_handle_t link)
+{
+    if (link == NULL)
+    {
+        return 0;
+    }
+
+    int credit = 0;
+
+    _vic_link_lock(ef, link);
+
+    if (link->ring)
+    {
+        size_t window = _vic_local_window(link, RING_BUFFER_CAPACITY);
+        size_t queued = ring_buffer_size(link->ring_tx);
+        credit = queued < window ? (int)(window - queued) : 0;
+    }
+    else if (link->shm)
+    {
+        size_t window = _vic_local_window(link, SHM_RING_DEFAULT_HWM);
+        size_t queued = shm_ring_size(link->shm_tx);
+        credit = queued < window && !shm_ring_full(link->shm_tx) ? (int)(window - queued) : 0;
+    }
+    else
+    {
+        zsock_t *sock = _vic_link_socket_lock(link);
+        credit = sock != NULL && zsock_events(sock) & ZMQ_POLLOUT ? 1 : 0;
+        _vic_link_socket_unlock(link);
+    }
+
+    _vic_link_unlock(ef, link);
+
+    return credit;
+}
+
+// Builds the header and the payload in a single message, which is then sent without another copy on the rings
+int _vic_call_send(vic_ef_t *ef, _vic_link_t *link, uint64_t id, enum _vic_call_kind_t kind, const void *data, size_t size)
+{
+    _vic_call_header_t header = {id, kind};
+
+    ring_message_t *message = ring_message_alloc(sizeof(header) + size);
+    memcpy(message->data, &header, sizeof(header));
+    memcpy(message->data + sizeof(header), data, size);
+    message->flags = MESSAGE_CALL;
+
+    return _vic_send_message(ef, link, message) == SEND_DONE ? 1 : -1;
+}
+
+// Receives calls until the one matching the condition is stored, must be called with the call lock.
+// A single waiter receives at a time and stores every call for its owner, the others sleep on the condition:
+// this lets the replies complete in any order while several flows of the vic wait on the same link.
+// The plain receives of the link store the calls they get too, the receiving waiter then stops early.
+void _vic_call_receive(vic_ef_t *ef, _vic_link_t *link, bool (*ready)(_vic_link_t *, uint64_t), uint64_t id)
+{
+    while (!ready(link, id))
+    {
+        if (link->call_receiving)
+        {
+            pthread_cond_wait(&link->call_cond, &link->call_lock);
+            continue;
+        }
+
+        link->call_receiving = true;
+        pthread_mutex_unlock(&link->call_lock);
+
+        _vic_call_wait_t wait = {link, ready, id};
+        _vic_call_header_t header;
+        vic_frame_t frame;
+
+        _vic_call_waiting = &wait;
+        int received = _vic_recv_message(ef, link, &frame, &header);
+        _vic_call_waiting = NULL;
+
+        if (received && header.kind == CALL_PLAIN)
+        {
+            // A plain message, kept for the next receive of the link
+            _vic_link_lock(ef, link);
+            cc_push(&link->plain, ring_message_new(frame.data, frame.size));
+            _vic_link_unlock(ef, link);
+            vic_frame_release(&frame);
+        }
+
+        pthread_mutex_lock(&link->call_lock);
+        link->call_receiving = false;
+
+        if (received && header.kind != CALL_PLAIN)
+        {
+            _vic_call_store(link, &header, &frame);
+        }
+
+        pthread_cond_broadcast(&link->call_cond);
+    }
+}
+
+bool _vic_call_reply_ready(_vic_link_t *link, uint64_t id)
+{
+    return cc_get(&link->replies, id) != NULL;
+}
+
+bool _vic_call_request_ready(_vic_link_t *link, uint64_t id)
+{
+    (void)id;
+    return cc_size(&link->requests) > 0;
+}
+
+vic_call_id_t vic_ef_call_async(vic_ef_t *ef, vic_link_handle_t link, const void *data, size_t size)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&link->call_lock);
+    uint64_t id = ++link->call_id;
+    pthread_mutex_unlock(&link->call_lock);
+
+    return _vic_call_send(ef, link, id, CALL_REQUEST, data, size) == 1 ? id : 0;
+}
+
+int vic_ef_call_wait(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t id, vic_frame_t *reply)
+{
+    if (link == NULL || link->role != LINK_PAIR || id == 0)
+    {
+        _vic_frame_set(reply, NULL, 0, NULL, NULL, NULL);
+        return 0;
+    }
+
+    pthread_mutex_lock(&link->call_lock);
+    _vic_call_receive(ef, link, _vic_call_reply_ready, id);
+
+    *reply = *cc_get(&link->replies, id);
+    cc_erase(&link->replies, id);
+    pthread_mutex_unlock(&link->call_lock);
+
+    return 1;
+}
+
+int vic_ef_recv_request(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t *id, vic_frame_t *request)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        _vic_frame_set(request, NULL, 0, NULL, NULL, NULL);
+        return 0;
+    }
+
+    pthread_mutex_lock(&link->call_lock);
+    _vic_call_receive(ef, link, _vic_call_request_ready, 0);
+
+    _vic_call_t *call = cc_first(&link->requests);
+    *id = call->id;
+    *request = call->frame;
+    cc_erase(&link->requests, call);
+    pthread_mutex_unlock(&link->call_lock);
+
+    return 1;
+}
+
+int vic_ef_reply(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t id, const void *data, size_t size)
+{
+    if (link == NULL || link->role != LINK_PAIR)
+    {
+        return 0;
+    }
+
+    return _vic_call_send(ef, link, id, CALL_REPLY, data, size);
+}
+
+// Checks whether a subscriber receives a topic, must be called with the lock of the broadcast group
+bool _vic_topic_match(_vic_link_t *subscriber, const char *topic, size_t topic_size)
+{
+    cc_for_each(&subscriber->topics, prefix)
+    {
+        size_t prefix_size = strlen(*prefix);
+        if (prefix_size <= topic_size && memcmp(*prefix, topic, prefix_size) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int vic_ef_subscribe(vic_ef_t *ef, vic_link_handle_t link, const char *prefix)
+{
+    if (link == NULL || link->role != LINK_SUBSCRIBER)
+    {
+        return 0;
+    }
+
+    _vic_link_lock(ef, link);
+
+    pthread_mutex_lock(&link->broadcast->lock);
+    cc_push(&link->topics, strdup(prefix));
+    pthread_mutex_unlock(&link->broadcast->lock);
+
+    if (link->zmq_sock != NULL)
+    {
+        zsock_set_subscribe(link->zmq_sock, prefix);
+    }
+
+    _vic_link_unlock(ef, link);
+
+    return 1;
+}
+
+int vic_ef_unsubscribe(vic_ef_t *ef, vic_link_handle_t link, const char *prefix)
+{
+    if (link == NULL || link->role != LINK_SUBSCRIBER)
+    {
+        return 0;
+    }
+
+    _vic_link_lock(ef, link);
+
+    pthread_mutex_lock(&link->broadcast->lock);
+    char **topic = cc_first(&link->topics);
+    for (; topic != cc_end(&link->topics); topic = cc_next(&link->topics, topic))
+    {
+        if (strcmp(*topic, prefix) == 0)
+        {
+            free(*topic);
+            cc_erase(&link->topics, topic);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&link->broadcast->lock);
+
+    if (link->zmq_sock != NULL)
+    {
+        zsock_set_unsubscribe(link->zmq_sock, prefix);
+    }
+
+    _vic_link_unlock(ef, link);
+
+    return 1;
+}
+
+// Pushes one copy of the publication to the receiving ring of every matching subscriber.
+// Like a PUB socket, a subscriber above the high-water mark misses the publication instead of blocking the publisher.
+enum _send_result_t _vic_ring_publish(vic_ef_t *ef, _vic_link_t *link, const char *topic, const void *data, size_t size)
+{
+    size_t topic_size = strlen(topic);
+
+    // The topic size and the topic are stored in front of the payload
+    ring_message_t *message = ring_message_alloc(sizeof(size_t) + topic_size + size);
+    memcpy(message->data, &topic_size, sizeof(size_t));
+    memcpy(message->data + sizeof(size_t), topic, topic_size);
+    memcpy(message->data + sizeof(size_t) + topic_size, data, size);
+
+    size_t window = _vic_local_window(link, RING_BUFFER_CAPACITY);
+
+    _vic_link_lock(ef, link);
+
+    if (!link->ring)
+    {
+        _vic_link_unlock(ef, link);
+        free(message);
+        return SEND_FALLBACK;
+    }
+
+    _vic_broadcast_t *broadcast = link->broadcast;
+    pthread_mutex_lock(&broadcast->lock);
+
+    // All the references are taken before the first push, so no subscriber frees the message while it is being pushed
+    int matching = 0;
+    cc_for_each(&broadcast->subscribers, subscriber)
+    {
+        matching += _vic_topic_match(*subscriber, topic, topic_size);
+    }
+
+    if (matching == 0)
+    {
+        free(message);
+    }
+    else
+    {
+        atomic_store(&message->references, matching);
+
+        cc_for_each(&broadcast->subscribers, subscriber)
+        {
+            if (!_vic_topic_match(*subscriber, topic, topic_size))
+            {
+                continue;
+            }
+
+            ring_buffer_t *ring = (*subscriber)->ring_rx;
+            if (ring_buffer_size(ring) >= window || !ring_buffer_push(ring, message))
+            {
+                ring_message_release(message);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&broadcast->lock);
+    _vic_link_unlock(ef, link);
+
+    return SEND_DONE;
+}
+
+int vic_ef_publish(vic_ef_t *ef, vic_link_handle_t link, const char *topic, const void *data, size_t size)
+{
+    if (link == NULL || link->role != LINK_PUBLISHER)
+    {
+        return 0;
+    }
+
+    if (_vic_ring_publish(ef, link, topic, data, size) == SEND_DONE)
+    {
+        return 1;
+    }
+
+    // The topic goes in its own frame, SUB sockets filter on the prefix of the first frame
+    zmsg_t *message = zmsg_new();
+    zmsg_addmem(message, topic, strlen(topic));
+    zmsg_addmem(message, data, size);
+
+    _vic_link_lock(ef, link);
+    _vic_link_establish(link);
+    if (link->zmq_sock != NULL)
+    {
+        zmsg_send(&message, link->zmq_sock);
+    }
+    _vic_link_unlock(ef, link);
+
+    // A PUB socket never blocks, the message is only left behind if the send failed
+    zmsg_destroy(&message);
+
+    return 1;
+}
+
+void _vic_zmsg_release(void *owner, void *context)
+{
+    (void)context;
+    zmsg_t *message = (zmsg_t *)owner;
+    zmsg_destroy(&message);
+}
+
+int vic_ef_recv_publication(vic_ef_t *ef, vic_link_handle_t link, vic_frame_t *topic, vic_frame_t *payload)
+{
+    _vic_frame_set(topic, NULL, 0, NULL, NULL, NULL);
+
+    if (link == NULL || link->role != LINK_SUBSCRIBER)
+    {
+        _vic_frame_set(payload, NULL, 0, NULL, NULL, NULL);
+        return 0;
+    }
+
+    if (_vic_recv_local(ef, link, payload, NULL))
+    {
+        const unsigned char *data = payload->data;
+        size_t topic_size = 0;
+        memcpy(&topic_size, data, sizeof(size_t));
+
+        // Both views point into the shared message, which is released with the payload
+        _vic_frame_set(topic, data + sizeof(size_t), topic_size, NULL, NULL, NULL);
+        payload->data = data + sizeof(size_t) + topic_size;
+        payload->size -= sizeof(size_t) + topic_size;
+        return 1;
+    }
+
+    zmsg_t *message = NULL;
+    while (message == NULL || zmsg_size(message) != 2)
+    {
+        zmsg_destroy(&message);
+
+        _vic_link_lock(ef, link);
+        _vic_link_establish(link);
+        zsock_t *sock = link->zmq_sock;
+        if (sock != NULL && _vic_socket_wait_in(sock))
+        {
+            message = zmsg_recv(sock);
+        }
+        _vic_link_unlock(ef, link);
+
+        if (sock == NULL)
+        {
+            zclock_sleep(1);
+        }
+    }
+
+    zframe_t *topic_frame = zmsg_first(message);
+    zframe_t *payload_frame = zmsg_next(message);
+
+    _vic_frame_set(topic, zframe_data(topic_frame), zframe_size(topic_frame), NULL, NULL, NULL);
+    _vic_frame_set(payload, zframe_data(payload_frame), zframe_size(payload_frame), message, NULL, _vic_zmsg_release);
+    return 1;
+}
+
+// Events of a link that can be served without the zmq socket, including the messages left behind by a transformation
+short _vic_link_local_events(_vic_link_t *link, short events)
+{
+    short revents = 0;
+
+    if (events & VIC_POLLIN)
+    {
+        if (cc_size(&link->spill) > 0 || cc_size(&link->plain) > 0 || !ring_buffer_empty(link->ring_rx) || (link->shm_rx != NULL && !shm_ring_empty(link->shm_rx)))
+        {
+            revents |= VIC_POLLIN;
+        }
+    }
+
+    if (events & VIC_POLLOUT)
+    {
+        if ((link->ring && !ring_buffer_full(link->ring_tx)) || (link->shm && !shm_ring_full(link->shm_tx)))
+        {
+            revents |= VIC_POLLOUT;
+        }
+    }
+
+    return revents;
+}
+
+// Events of a link sharing a socket, the socket is skipped if another user holds it
+short _vic_mux_events(_vic_link_t *link, short events)
+{
+    short revents = 0;
+
+    if (pthread_mutex_trylock(&link->mux->lock) != 0)
+    {
+        return revents;
+    }
+
+    _vic_mux_drain(link->mux);
+
+    if (events & VIC_POLLIN && cc_size(&link->mux_inbox) > 0)
+    {
+        revents |= VIC_POLLIN;
+    }
+
+    if (events & VIC_POLLOUT && link->mux->sock != NULL && zsock_events(link->mux->sock) & ZMQ_POLLOUT)
+    {
+        revents |= VIC_POLLOUT;
+    }
+
+    pthread_mutex_unlock(&link->mux->lock);
+
+    return revents;
+}
+
+// zpoller only reports readable sockets, so the zmq links are polled with zmq_poll to get POLLOUT as well.
+// The local links have no file descriptor to sleep on, they are checked between short zmq_poll slices.
+int vic_ef_poll(vic_ef_t *ef, vic_pollitem_t *items, int count, int timeout_ms)
+{
+    zmq_pollitem_t *zmq_items = malloc(sizeof(zmq_pollitem_t) * count);
+    int *zmq_indexes = malloc(sizeof(int) * count);
+
+    int64_t deadline = timeout_ms < 0 ? -1 : zclock_mono() + timeout_ms;
+
+    int ready = 0;
+    unsigned int spins = 0;
+    for (;;)
+    {
+        int zmq_count = 0;
+        bool local = false;
+
+        _ef_enter(ef);
+
+        for (int i = 0; i < count; i++)
+        {
+            _vic_link_t *link = items[i].link;
+            items[i].revents = 0;
+
+            if (link == NULL)
+            {
+                continue;
+            }
+
+            items[i].revents = _vic_link_local_events(link, items[i].events);
+
+            if (link->ring || link->shm)
+            {
+                local = true;
+            }
+            else if (link->mux != NULL)
+            {
+                // The socket is shared with other links, it is checked between the slices like the local links
+                local = true;
+                items[i].revents |= _vic_mux_events(link, items[i].events);
+            }
+            else if (pthread_mutex_trylock(&link->lock) == 0)
+            {
+                // A link busy with a send or a receive is skipped for this slice, zmq sockets are not thread safe
+                _vic_link_establish(link);
+                if (link->zmq_sock == NULL)
+                {
+                    pthread_mutex_unlock(&link->lock);
+                    continue;
+                }
+
+                zmq_items[zmq_count].socket = zsock_resolve(link->zmq_sock);
+                zmq_items[zmq_count].fd = 0;
+                zmq_items[zmq_count].events = (items[i].events & VIC_POLLIN ? ZMQ_POLLIN : 0) | (items[i].events & VIC_POLLOUT ? ZMQ_POLLOUT : 0);
+                zmq_items[zmq_count].revents = 0;
+                zmq_indexes[zmq_count] = i;
+                zmq_count++;
+            }
+        }
+
+        ready = 0;
+        for (int i = 0; i < count; i++)
+        {
+            ready += items[i].revents != 0;
+        }
+
+        if (zmq_count > 0)
+        {
+            long slice = 0;
+            if (ready == 0 && !local)
+            {
+                int64_t remaining = deadline < 0 ? LOCAL_WAIT_TIMEOUT_MS : deadline - zclock_mono();
+                slice = remaining < LOCAL_WAIT_TIMEOUT_MS ? (remaining > 0 ? remaining : 0) : LOCAL_WAIT_TIMEOUT_MS;
+            }
+
+            if (zmq_poll(zmq_items, zmq_count, slice) > 0)
+            {
+                for (int i = 0; i < zmq_count; i++)
+                {
+                    vic_pollitem_t *item = &items[zmq_indexes[i]];
+                    short revents = (zmq_items[i].revents & ZMQ_POLLIN ? VIC_POLLIN : 0) | (zmq_items[i].revents & ZMQ_POLLOUT ? VIC_POLLOUT : 0);
+
+                    ready += item->revents == 0 && revents != 0;
+                    item->revents |= revents;
+                }
+            }
+        }
+
+        for (int i = 0; i < zmq_count; i++)
+        {
+            pthread_mutex_unlock(&items[zmq_indexes[i]].link->lock);
+        }
+
+        _ef_leave(ef);
+
+        if (ready > 0 || (deadline >= 0 && zclock_mono() >= deadline))
+        {
+            break;
+        }
+
+        if (local)
+        {
+            ring_buffer_backoff(&spins);
+        }
+        else if (zmq_count == 0)
+        {
+            // Nothing to wait on yet, the links are not established
+            zclock_sleep(1);
+        }
+    }
+
+    free(zmq_items);
+    free(zmq_indexes);
+
+    return ready;
+}
+
+// Depth of the operations the current thread is inside of, per execution flow: the nested operations of a flow
+// never wait for its barrier, the operations of another flow still do
+typedef struct
+{
+    vic_ef_t *ef;       // The execution flow, the slot is free when depth is 0
+    unsigned int depth; // Number of operations of the flow the thread is inside of
+} _ef_depth_t;
+
+static _Thread_local _ef_depth_t _ef_depths[EF_DEPTH_SLOTS];
+
+// The slot of the flow, a free one if the thread is not inside its operations
+_ef_depth_t *_ef_depth(vic_ef_t *ef)
+{
+    _ef_depth_t *slot = NULL;
+    for (int i = 0; i < EF_DEPTH_SLOTS; i++)
+    {
+        if (_ef_depths[i].depth > 0 && _ef_depths[i].ef == ef)
+        {
+            return &_ef_depths[i];
+        }
+
+        if (_ef_depths[i].depth == 0 && slot == NULL)
+        {
+            slot = &_ef_depths[i];
+        }
+    }
+
+    assert(slot != NULL);
+    slot->ef = ef;
+    return slot;
+}
+
+void _ef_enter(vic_ef_t *ef)
+{
+    if (_ef_depth(ef)->depth++ > 0)
+    {
+        atomic_fetch_add(&ef->active, 1);
+        return;
+    }
+
+    unsigned int spins = 0;
+    for (;;)
+    {
+        atomic_fetch_add(&ef->active, 1);
+        if (!atomic_load(&ef->quiescing))
+        {
+            return;
+        }
+
+        atomic_fetch_sub(&ef->active, 1);
+        while (atomic_load(&ef->quiescing))
+        {
+            if (spins < 1024)
+            {
+                spins++;
+                sched_yield();
+            }
+            else
+            {
+                usleep(1000);
+            }
+        }
+    }
+}
+
+void _ef_leave(vic_ef_t *ef)
+{
+    _ef_depth(ef)->depth--;
+    atomic_fetch_sub(&ef->active, 1);
+}
+
+unsigned long long _ef_region(vic_ef_t *ef)
+{
+    return ef != NULL ? ef->region : 0;
+}
+
+// Transformation side of the barrier: new operations wait and the running ones are allowed to finish
+void _ef_quiesce(vic_ef_t *ef)
+{
+    atomic_store(&ef->quiescing, 1);
+    while (atomic_load(&ef->active) > 0)
+    {
+        usleep(1000);
+    }
+}
+
+void _ef_resume(vic_ef_t *ef)
+{
+    atomic_store(&ef->quiescing, 0);
 }
 
-void _ef_lock(vic_ef_t *ef)
+void _vic_link_lock(vic_ef_t *ef, _vic_link_t *link)
 {
-    pthread_mutex_lock(&ef->lock);
+    _ef_enter(ef);
+    pthread_mutex_lock(&link->lock);
 }
 
-void _ef_unlock(vic_ef_t *ef)
+void _vic_link_unlock(vic_ef_t *ef, _vic_link_t *link)
 {
-    pthread_mutex_unlock(&ef->lock);
+    pthread_mutex_unlock(&link->lock);
+    _ef_leave(ef);
 }
@@ -7,8 +7,16 @@ typedef struct _vic_t vic_t;
 // Forward declaration of the execution flow structure
 typedef struct _vic_ef_t vic_ef_t;
 
+// Resolved link of an execution flow, stays valid across vic transformations
+typedef struct _vic_link_t *vic_link_handle_t;
+
 #include "dynamic_allocation.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
 data_ptr_definion(char)
 
 enum vic_abstraction_t {
@@ -16,6 +24,25 @@ enum vic_abstraction_t {
     EF_PROCESS = 0x02
 };
 
+// Events of vic_pollitem_t
+#define VIC_POLLIN 0x01  // A message can be received from the link without blocking
+#define VIC_POLLOUT 0x02 // A message can be sent to the link without blocking
+
+// Borrowed view of a received binary message, valid until vic_frame_release is called
+typedef struct {
+    const void *data;                 // Pointer to the message payload
+    size_t size;                      // Size of the message payload in bytes
+    void *_owner;                     // The zmq frame, the ring message or the shared memory record owning the payload
+    void *_context;                   // The ring the owner belongs to, if any
+    void (*_release)(void *, void *); // Function releasing the owner
+} vic_frame_t;
+
+// Keep the data_ptr allocations in a heap shared by all the processes of the program, must be called before vic_init.
+// The transformations then move no heap data and vic_ef_send_ptr only sends keys, whatever the abstraction.
+// size is the address space reserved for the heap, only the touched pages are backed by memory.
+// Returns 0 if the shared heap cannot be created, the private heap is used then.
+int vic_use_shared_heap(size_t size);
+
 // Initialize the ef library and return a pointer to the root execution flow
 vic_t *vic_init();
 
@@ -26,23 +53,206 @@ vic_ef_t *vic_ef_create(vic_t *vic, void (*start_routine)(vic_t *), void (*finis
 
 vic_ef_t *vic_ef_get(vic_t *vic);
 
+// Flags of vic_set_socket_flags
+#define VIC_SOCKETS_MULTIPLEXED 0x01 // The links made afterwards between this vic and the same peer share one zmq socket
+#define VIC_SOCKETS_LAZY 0x02        // The sockets are established on the first use of their link
+#define VIC_SOCKETS_BACKGROUND 0x04  // The sockets are established by a background thread, or on first use if that comes earlier
+
+// Choose how the zmq sockets of the links of the vic are established, before the links are made.
+// The lazy and background modes apply to the start of the vic and to the resume after every transformation.
+// A multiplexed link ignores its high-water marks, they belong to the shared socket.
+void vic_set_socket_flags(vic_t *vic, int flags);
+
 void vic_destroy(vic_t *vic);
 
+// Destroy an execution flow, the data_ptr allocations made for it are released
 void vic_ef_destroy(vic_ef_t *ef);
 
+// Release every data_ptr allocation made for the execution flow at once, their handles become stale.
+// No other execution flow may use them meanwhile, a pinned one is freed by its vic_unpin. The allocations received
+// with vic_ef_recv_ptr belong to the receiver, the ones sent away no longer belong to the sender.
+void vic_ef_heap_reset(vic_ef_t *ef);
+
+// The send functions return 1 if the message is sent, 0 if there is no such link,
+// and -1 if the link is full and its policy does not allow to wait
 int vic_ef_send(vic_ef_t *ef, const char* name, const char data[]);
 
 data_ptr(char) vic_ef_recv(vic_ef_t *ef, const char* name);
 
+// Send a binary message of an explicit size, embedded NULs are allowed
+int vic_ef_send_buf(vic_ef_t *ef, const char* name, const void *data, size_t size);
+
+// Receive a binary message into the caller supplied buffer
+// Returns the full size of the message (the copy is truncated to capacity) or -1 if there is no such link
+ssize_t vic_ef_recv_buf(vic_ef_t *ef, const char* name, void *buffer, size_t capacity);
+
+// Receive a binary message without copying it, the frame must be released with vic_frame_release
+int vic_ef_recv_frame(vic_ef_t *ef, const char* name, vic_frame_t *frame);
+
+void vic_frame_release(vic_frame_t *frame);
+
+// Resolve a link by name once, returns NULL if the vic of the execution flow has no such link
+vic_link_handle_t vic_ef_link(vic_ef_t *ef, const char* name);
+
+// Variants of the send/recv functions working on a resolved link
+int vic_ef_send_h(vic_ef_t *ef, vic_link_handle_t link, const char data[]);
+
+data_ptr(char) vic_ef_recv_h(vic_ef_t *ef, vic_link_handle_t link);
+
+int vic_ef_send_buf_h(vic_ef_t *ef, vic_link_handle_t link, const void *data, size_t size);
+
+ssize_t vic_ef_recv_buf_h(vic_ef_t *ef, vic_link_handle_t link, void *buffer, size_t capacity);
+
+int vic_ef_recv_frame_h(vic_ef_t *ef, vic_link_handle_t link, vic_frame_t *frame);
+
+int _vic_ef_send_ptr(vic_ef_t *ef, vic_link_handle_t link, data_pointer ptr);
+data_pointer _vic_ef_recv_ptr(vic_ef_t *ef, vic_link_handle_t link, size_t type_size);
+
+// Move an allocation to the other end of the link, the sender must not use the data_ptr afterwards.
+// Between threads, or through a shared heap, only the key of the allocation is sent. Otherwise the sender copies
+// the content into the transport and the receiver keeps the received buffer, unless it comes from the shared memory
+// ring, which it is copied out of.
+#define vic_ef_send_ptr(ef, name, ptr) _vic_ef_send_ptr(ef, vic_ef_link(ef, name), base_ptr(ptr))
+#define vic_ef_send_ptr_h(ef, link, ptr) _vic_ef_send_ptr(ef, link, base_ptr(ptr))
+
+// Receive an allocation moved with vic_ef_send_ptr, NULLPTR if it does not hold elements of the type
+#define vic_ef_recv_ptr(type, ef, name) _from_base_##type(_vic_ef_recv_ptr(ef, vic_ef_link(ef, name), sizeof(type)), ef)
+#define vic_ef_recv_ptr_h(type, ef, link) _from_base_##type(_vic_ef_recv_ptr(ef, link, sizeof(type)), ef)
+
+// What a send does when the queue of the link is full
+enum vic_link_policy_t {
+    VIC_LINK_BLOCK = 0,      // Wait until the receiver makes room
+    VIC_LINK_NONBLOCK = 1,   // Return -1 without sending the message
+    VIC_LINK_DROP_OLDEST = 2 // Drop the oldest queued message, zmq and shared memory links drop the new one
+};
+
+// Flow control of a link
+typedef struct {
+    int send_hwm;                  // Maximum number of queued outgoing messages, 0 keeps the default
+    int recv_hwm;                  // Maximum number of queued incoming messages of zmq sockets, 0 keeps the default
+    enum vic_link_policy_t policy; // What a send does when the queue is full
+} vic_link_options_t;
+
+// Configure the flow control of a link before the execution flows use it:
+// the high-water marks of zmq sockets only apply to the connections made afterwards,
+// and switching the rings to VIC_LINK_DROP_OLDEST is not safe while the other end receives
+void vic_link_configure(vic_ef_t *ef, vic_link_handle_t link, const vic_link_options_t *options);
+
+// Number of messages that can be sent without blocking, exact for local links and 0 or 1 for zmq links
+int vic_ef_send_credit(vic_ef_t *ef, vic_link_handle_t link);
+
+// Link to wait on with vic_ef_poll
+typedef struct {
+    vic_link_handle_t link; // The resolved link
+    short events;           // The VIC_POLL* events to wait for
+    short revents;          // The VIC_POLL* events ready on the link, set by vic_ef_poll
+} vic_pollitem_t;
+
+// Wait until at least one of the links is ready or timeout_ms expires (-1 waits forever)
+// Returns the number of ready links, 0 on timeout
+int vic_ef_poll(vic_ef_t *ef, vic_pollitem_t *items, int count, int timeout_ms);
+
 // Link two execution flows together
 void vic_link(vic_t *vic1, vic_t *vic2, const char *name);
 
+// Correlation id of a call, 0 is never a valid id
+typedef uint64_t vic_call_id_t;
+
+// A link used for calls may carry plain messages too, the transports mark the calls apart from the payload.
+// The plain messages received while waiting for a call are kept for vic_ef_recv*, and the calls received
+// by vic_ef_recv* are kept for their waiters.
+
+// Send a request without waiting for the reply, many calls may be in flight on the same link.
+// Returns the id to wait for, 0 if there is no such link or the link is full and its policy does not allow to wait.
+vic_call_id_t vic_ef_call_async(vic_ef_t *ef, vic_link_handle_t link, const void *data, size_t size);
+
+// Wait for the reply of a call, the replies may arrive in any order.
+// The reply must be released with vic_frame_release.
+int vic_ef_call_wait(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t id, vic_frame_t *reply);
+
+// Receive the next request of the other end, the request must be released with vic_frame_release
+int vic_ef_recv_request(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t *id, vic_frame_t *request);
+
+// Answer the request with the given id, requests may be answered in any order
+int vic_ef_reply(vic_ef_t *ef, vic_link_handle_t link, vic_call_id_t id, const void *data, size_t size);
+
+// Create a one-to-many link: every publication of the publisher is delivered to the subscribers of its topic.
+// Thread subscribers share a single copy of the message, process subscribers use zmq PUB/SUB.
+void vic_broadcast(vic_t *publisher, vic_t *subscribers[], int count, const char *name);
+
+// Receive the publications whose topic starts with prefix, "" receives everything.
+// A subscriber receives nothing until its first subscription.
+int vic_ef_subscribe(vic_ef_t *ef, vic_link_handle_t link, const char *prefix);
+
+int vic_ef_unsubscribe(vic_ef_t *ef, vic_link_handle_t link, const char *prefix);
+
+// Publish a message once for all the subscribers, never blocks: a subscriber whose queue is full misses it.
+// Returns 0 if the link is not the publishing end of a broadcast link.
+int vic_ef_publish(vic_ef_t *ef, vic_link_handle_t link, const char *topic, const void *data, size_t size);
+
+// Receive the next publication, the topic is not NUL terminated.
+// Both frames are borrowed until vic_frame_release is called on the payload.
+int vic_ef_recv_publication(vic_ef_t *ef, vic_link_handle_t link, vic_frame_t *topic, vic_frame_t *payload);
+
 // Start an execution flow
 void vic_ef_start(vic_ef_t *ef);
 
 // Wait for an execution flow to finish
 void vic_ef_wait(vic_ef_t *ef);
 
+// Typed messages over a link. The value is copied as is into the message, so the type must be plain old data:
+// no pointers, and both ends have to agree on the layout, which holds for all the vics of a program.
+// The receive functions return 1 on success, 0 if there is no such link and -1 if the message does not have
+// the size of the type, the message is dropped then.
+#define channel_definition(type) \
+    int send_##type(vic_ef_t* ef, vic_link_handle_t link, type value); \
+    int send_array_##type(vic_ef_t* ef, vic_link_handle_t link, const type values[], unsigned int size); \
+    int recv_##type(vic_ef_t* ef, vic_link_handle_t link, type* out_value); \
+    ssize_t recv_array_##type(vic_ef_t* ef, vic_link_handle_t link, type out_array[], unsigned int capacity);
+
+// recv_array_##type returns the number of elements of the message (the copy is truncated to capacity),
+// or -1 as vic_ef_recv_buf does if there is no such link or the message is not made of whole elements
+#define channel_implementation(type) \
+    int send_##type(vic_ef_t* ef, vic_link_handle_t link, type value) { \
+        return vic_ef_send_buf_h(ef, link, &value, sizeof(type)); \
+    } \
+    \
+    int send_array_##type(vic_ef_t* ef, vic_link_handle_t link, const type values[], unsigned int size) { \
+        return vic_ef_send_buf_h(ef, link, values, (size_t)size * sizeof(type)); \
+    } \
+    \
+    int recv_##type(vic_ef_t* ef, vic_link_handle_t link, type* out_value) { \
+        vic_frame_t frame; \
+        if (!vic_ef_recv_frame_h(ef, link, &frame)) { \
+            return 0; \
+        } \
+        int result = frame.size == sizeof(type) ? 1 : -1; \
+        if (result == 1) { \
+            memcpy(out_value, frame.data, sizeof(type)); \
+        } \
+        vic_frame_release(&frame); \
+        return result; \
+    } \
+    \
+    ssize_t recv_array_##type(vic_ef_t* ef, vic_link_handle_t link, type out_array[], unsigned int capacity) { \
+        vic_frame_t frame; \
+        if (!vic_ef_recv_frame_h(ef, link, &frame)) { \
+            return -1; \
+        } \
+        if (frame.size % sizeof(type) != 0) { \
+            vic_frame_release(&frame); \
+            return -1; \
+        } \
+        size_t count = frame.size / sizeof(type); \
+        memcpy(out_array, frame.data, (count < capacity ? count : capacity) * sizeof(type)); \
+        vic_frame_release(&frame); \
+        return (ssize_t)count; \
+    }
+
+#define define_channel(type) \
+    channel_definition(type) \
+    channel_implementation(type)
+
 
 
 #endif // VIC_LIB_H
\ No newline at end of file